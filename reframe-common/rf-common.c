@@ -1,6 +1,9 @@
+#include <string.h>
 #include <grp.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <xf86drmMode.h>
+#include <gio/gunixfdmessage.h>
 
 #include "config.h"
 #include "rf-common.h"
@@ -31,6 +34,10 @@ void rf_buffer_debug(struct rf_buffer *b)
 		(b->md.fourcc >> 16) & 0xff,
 		(b->md.fourcc >> 24) & 0xff,
 		b->md.modifier);
+	g_debug("Frame: Got buffer framebuffer ID %u, slot %u, %s.",
+		b->md.fb_id,
+		b->md.slot,
+		b->md.cached ? "cached" : "not cached");
 	g_debug("Frame: Got buffer fds: %d %d %d %d.",
 		b->fds[0],
 		b->fds[1],
@@ -48,23 +55,134 @@ void rf_buffer_debug(struct rf_buffer *b)
 		b->md.pitches[3]);
 }
 
-ssize_t rf_send_header(
+ssize_t rf_send_msg(
 	GSocketConnection *connection,
 	char type,
 	size_t length,
+	const void *payload,
+	size_t size,
+	int *fds,
+	int n_fds,
 	GError **error
 )
 {
 	ssize_t ret = 0;
-	GOutputStream *os =
-		g_io_stream_get_output_stream(G_IO_STREAM(connection));
-	ret = g_output_stream_write(os, &type, sizeof(type), NULL, error);
+	char header[sizeof(type) + sizeof(length)];
+	header[0] = type;
+	memcpy(&header[sizeof(type)], &length, sizeof(length));
+	GOutputVector iov[2] = { { header, sizeof(header) }, { payload, size } };
+	GSocketControlMessage *msg = NULL;
+	if (n_fds > 0) {
+		// This takes the ownership of fds.
+		GUnixFDList *list = g_unix_fd_list_new_from_array(fds, n_fds);
+		msg = g_unix_fd_message_new_with_fd_list(list);
+		g_clear_object(&list);
+	}
+	GSocket *socket = g_socket_connection_get_socket(connection);
+	ret = g_socket_send_message(
+		socket,
+		NULL,
+		iov,
+		size > 0 ? 2 : 1,
+		msg != NULL ? &msg : NULL,
+		msg != NULL ? 1 : 0,
+		G_SOCKET_MSG_NONE,
+		NULL,
+		error
+	);
+	g_clear_object(&msg);
+	if (ret >= 0 && (size_t)ret < sizeof(header) + size) {
+		g_set_error(
+			error,
+			G_IO_ERROR,
+			G_IO_ERROR_FAILED,
+			"Sent %ld bytes of %ld bytes message",
+			ret,
+			sizeof(header) + size
+		);
+		ret = -1;
+	}
+	return ret;
+}
+
+ssize_t rf_receive_header(
+	GSocketConnection *connection,
+	char *type,
+	size_t *length,
+	int **fds,
+	int *n_fds,
+	GError **error
+)
+{
+	ssize_t ret = 0;
+	char header[sizeof(*type) + sizeof(*length)];
+	GInputVector iov = { header, sizeof(header) };
+	GSocketControlMessage **msgs = NULL;
+	int n_msgs = 0;
+	GSocket *socket = g_socket_connection_get_socket(connection);
+
+	if (fds != NULL) {
+		*fds = NULL;
+		*n_fds = 0;
+	}
+
+	ret = g_socket_receive_message(
+		socket, NULL, &iov, 1, &msgs, &n_msgs, NULL, NULL, error
+	);
+	for (int i = 0; i < n_msgs; ++i) {
+		// fds are attached to the first byte of message, so we won't
+		// miss them by reading header only. Unwanted fds will be closed
+		// by GUnixFDList.
+		if (fds != NULL && *fds == NULL &&
+		    G_IS_UNIX_FD_MESSAGE(msgs[i]))
+			*fds = g_unix_fd_message_steal_fds(
+				G_UNIX_FD_MESSAGE(msgs[i]), n_fds
+			);
+		g_clear_object(&msgs[i]);
+	}
+	g_free(msgs);
 	if (ret <= 0)
-		return ret;
-	ret = g_output_stream_write(os, &length, sizeof(length), NULL, error);
+		goto out;
+
+	if ((size_t)ret < sizeof(header)) {
+		ssize_t rest = rf_receive_payload(
+			connection, &header[ret], sizeof(header) - ret, error
+		);
+		if (rest <= 0) {
+			ret = rest;
+			goto out;
+		}
+	}
+	*type = header[0];
+	memcpy(length, &header[sizeof(*type)], sizeof(*length));
+
+out:
+	if (ret <= 0 && fds != NULL && *fds != NULL) {
+		for (int i = 0; i < *n_fds; ++i)
+			close((*fds)[i]);
+		g_clear_pointer(fds, g_free);
+		*n_fds = 0;
+	}
 	return ret;
 }
 
+ssize_t rf_receive_payload(
+	GSocketConnection *connection,
+	void *payload,
+	size_t size,
+	GError **error
+)
+{
+	size_t n = 0;
+	GInputStream *is = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+	if (!g_input_stream_read_all(is, payload, size, &n, NULL, error))
+		return -1;
+	// Got EOF before reading all.
+	if (n < size)
+		return 0;
+	return n;
+}
+
 const char *rf_plane_type(uint32_t type)
 {
 	switch (type) {
@@ -110,3 +228,160 @@ bool rf_is_landscape(unsigned int rotation)
 {
 	return rotation % 180 == 0;
 }
+
+// Bytes per pixel.
+unsigned int rf_pixel_format_get_bpp(enum rf_pixel_format format)
+{
+	switch (format) {
+	case RF_PIXEL_FORMAT_RGB565:
+		return 2;
+	case RF_PIXEL_FORMAT_BGR233:
+		return 1;
+	default:
+		return RF_BYTES_PER_PIXEL;
+	}
+}
+
+size_t
+rf_pixel_format_get_stride(enum rf_pixel_format format, unsigned int width)
+{
+	const unsigned int pixels =
+		RF_BYTES_PER_PIXEL / rf_pixel_format_get_bpp(format);
+	return (size_t)(width + pixels - 1) / pixels * RF_BYTES_PER_PIXEL;
+}
+
+void rf_pixel_format_pack(
+	enum rf_pixel_format format,
+	const uint8_t *p,
+	uint8_t *d
+)
+{
+	uint16_t v = 0;
+	switch (format) {
+	case RF_PIXEL_FORMAT_BGRX8888:
+		d[0] = p[2];
+		d[1] = p[1];
+		d[2] = p[0];
+		d[3] = p[3];
+		break;
+	case RF_PIXEL_FORMAT_RGB565:
+		v = (p[0] * 31 + 127) / 255 << 11 |
+		    (p[1] * 63 + 127) / 255 << 5 | (p[2] * 31 + 127) / 255;
+		d[0] = v & 0xff;
+		d[1] = v >> 8;
+		break;
+	case RF_PIXEL_FORMAT_BGR233:
+		d[0] = (p[2] * 3 + 127) / 255 << 6 |
+		       (p[1] * 7 + 127) / 255 << 3 | (p[0] * 7 + 127) / 255;
+		break;
+	default:
+		memcpy(d, p, RF_BYTES_PER_PIXEL);
+		break;
+	}
+}
+
+void rf_region_clear(struct rf_region *region)
+{
+	region->length = 0;
+}
+
+bool rf_region_is_empty(const struct rf_region *region)
+{
+	return region->length == 0;
+}
+
+static inline uint64_t get_area(const struct rf_rect *rect)
+{
+	return (uint64_t)rect->w * rect->h;
+}
+
+static inline bool is_touched(const struct rf_rect *a, const struct rf_rect *b)
+{
+	return a->x <= b->x + (int)b->w && b->x <= a->x + (int)a->w &&
+	       a->y <= b->y + (int)b->h && b->y <= a->y + (int)a->h;
+}
+
+static inline void union_rect(struct rf_rect *a, const struct rf_rect *b)
+{
+	const int x1 = MIN(a->x, b->x);
+	const int y1 = MIN(a->y, b->y);
+	const int x2 = MAX(a->x + (int)a->w, b->x + (int)b->w);
+	const int y2 = MAX(a->y + (int)a->h, b->y + (int)b->h);
+	a->x = x1;
+	a->y = y1;
+	a->w = x2 - x1;
+	a->h = y2 - y1;
+}
+
+static inline void remove_rect(struct rf_region *region, unsigned int i)
+{
+	region->rects[i] = region->rects[--region->length];
+}
+
+// Rects touching the new one are merged into it. If there are already too many
+// rects, we merge it with the one that wastes the least area, which is cheaper
+// than sending a few more pixels.
+void rf_region_add(struct rf_region *region, const struct rf_rect *rect)
+{
+	if (rect->w == 0 || rect->h == 0)
+		return;
+
+	struct rf_rect merged = *rect;
+	bool changed = true;
+	// Merged rect is larger and may touch rects we already checked.
+	while (changed) {
+		changed = false;
+		for (unsigned int i = 0; i < region->length;) {
+			if (is_touched(&region->rects[i], &merged)) {
+				union_rect(&merged, &region->rects[i]);
+				remove_rect(region, i);
+				changed = true;
+			} else {
+				++i;
+			}
+		}
+	}
+
+	if (region->length == RF_MAX_RECTS) {
+		unsigned int best = 0;
+		uint64_t best_waste = UINT64_MAX;
+		for (unsigned int i = 0; i < region->length; ++i) {
+			struct rf_rect u = merged;
+			union_rect(&u, &region->rects[i]);
+			const uint64_t waste = get_area(&u) -
+					       get_area(&merged) -
+					       get_area(&region->rects[i]);
+			if (waste < best_waste) {
+				best = i;
+				best_waste = waste;
+			}
+		}
+		union_rect(&merged, &region->rects[best]);
+		remove_rect(region, best);
+		// It is not full now, but the union may touch others.
+		rf_region_add(region, &merged);
+		return;
+	}
+
+	region->rects[region->length++] = merged;
+}
+
+void rf_region_union(struct rf_region *region, const struct rf_region *other)
+{
+	for (unsigned int i = 0; i < other->length; ++i)
+		rf_region_add(region, &other->rects[i]);
+}
+
+void rf_region_debug(const struct rf_region *region, const char *name)
+{
+	for (unsigned int i = 0; i < region->length; ++i)
+		g_debug("Frame: Got %s %u: x %d, y %d, width %u, height %u.",
+			name,
+			i,
+			region->rects[i].x,
+			region->rects[i].y,
+			region->rects[i].w,
+			region->rects[i].h);
+	if (region->length == 0)
+		g_debug("Frame: Got empty %s.", name);
+}
@@ -16,15 +16,36 @@ G_BEGIN_DECLS
  * 2. Payload length, which is 1 size_t.
  * 3. Payload.
  *
+ * The whole message is sent with 1 `sendmsg()`, fds are sent with it as 1
+ * control message, so receivers must read the header with `recvmsg()` to get
+ * them.
+ *
  * Some messages does not have payload, then length should be 0 and cannot be
  * omitted. If payload is a string, it should contain the `\0`.
  *
  * The payload length is the number of elements. For frame type, 0 is always the
  * primary plane, follows with an optional cursor plane. The payload length could
- * be 0 for frame type, which means the monitor is currently empty.
+ * be 0 for frame type, which means the monitor is currently empty. Buffer
+ * metadata of all planes are sent as 1 payload, with fds of all uncached
+ * buffers in order.
+ *
+ * Server sends connector name first after connecting, Streamer then replies
+ * with card path and connector name it uses. An empty connector name means
+ * using Streamer's configuration.
+ *
+ * When Server requests a frame, non-0 payload length and no payload means
+ * Streamer must send a whole frame even if nothing changes. Streamer may reply
+ * with frame unchanged type, which has no payload, if planes are the same as the
+ * last frame, so Server could skip converting.
+ *
+ * Server may send an input channel message with 1 fd of a socket, then sends
+ * input messages via it, so Streamer could handle input in another thread
+ * without waiting for frames.
  */
 #define RF_MSG_TYPE_FRAME 'F'
+#define RF_MSG_TYPE_FRAME_UNCHANGED 'U'
 #define RF_MSG_TYPE_INPUT 'I'
+#define RF_MSG_TYPE_INPUT_CHANNEL 'C'
 #define RF_MSG_TYPE_CARD_PATH 'P'
 #define RF_MSG_TYPE_CONNECTOR_NAME 'N'
 #define RF_MSG_TYPE_CLIPBOARD_TEXT 'T'
@@ -35,11 +56,56 @@ G_BEGIN_DECLS
 
 #define RF_MAX_BUFS 2
 #define RF_MAX_FDS 4
+// Compositors typically use 2 to 4 framebuffers for primary plane and a few for
+// cursor plane.
+#define RF_MAX_SLOTS 8
+// Damage region is kept as a few rects, more rects are merged.
+#define RF_MAX_RECTS 16
 
 #define RF_KEY_CODE_XKB_TO_EV(key_code) ((key_code) - 8)
 
+struct rf_rect {
+	int x;
+	int y;
+	unsigned int w;
+	unsigned int h;
+};
+
+// Rects never overlap or touch each other, so they could be handled in any
+// order.
+struct rf_region {
+	unsigned int length;
+	struct rf_rect rects[RF_MAX_RECTS];
+};
+
+// Pixel formats that Server could convert frames into, in little endian bytes
+// order. Smaller formats pack a few pixels into 1 RGBA texel, so each row is
+// aligned to 4 bytes.
+enum rf_pixel_format {
+	RF_PIXEL_FORMAT_RGBX8888,
+	RF_PIXEL_FORMAT_BGRX8888,
+	RF_PIXEL_FORMAT_RGB565,
+	RF_PIXEL_FORMAT_BGR233
+};
+
 struct rf_buffer_metadata {
 	unsigned int length;
+	// Server keeps fds of framebuffers in slots, Streamer only sends fds
+	// when it registers a framebuffer into a slot. If cached, no fds are sent
+	// and Server should use fds in the slot.
+	unsigned int slot;
+	bool cached;
+	// Plane state is the same as in the last frame, only set if Streamer
+	// skips unchanged frames. Server may reuse what it converted from
+	// this plane.
+	bool unchanged;
+	// What compositor changed on this plane since the last frame, on
+	// monitor. Only valid if has_damage, otherwise Server needs to detect
+	// damage region itself.
+	bool has_damage;
+	struct rf_region damage;
+	// DRM framebuffer ID.
+	uint32_t fb_id;
 	// DRM plane type.
 	uint32_t type;
 	// See <https://events.static.linuxfound.org/sites/events/files/slides/brezillon-drm-kms.pdf>.
@@ -70,29 +136,53 @@ struct rf_buffer {
 	struct rf_buffer_metadata md;
 };
 
-struct rf_rect {
-	int x;
-	int y;
-	unsigned int w;
-	unsigned int h;
-};
-
 struct rf_auth {
 	pid_t pid;
 	bool ok;
 };
 
 void rf_buffer_debug(struct rf_buffer *b);
-ssize_t rf_send_header(
+ssize_t rf_send_msg(
 	GSocketConnection *connection,
 	char type,
 	size_t length,
+	const void *payload,
+	size_t size,
+	int *fds,
+	int n_fds,
+	GError **error
+);
+ssize_t rf_receive_header(
+	GSocketConnection *connection,
+	char *type,
+	size_t *length,
+	int **fds,
+	int *n_fds,
+	GError **error
+);
+ssize_t rf_receive_payload(
+	GSocketConnection *connection,
+	void *payload,
+	size_t size,
 	GError **error
 );
 const char *rf_plane_type(uint32_t type);
 int rf_set_group(const char *path);
 pid_t rf_get_socket_pid(GSocket *socket);
 bool rf_is_landscape(unsigned int rotation);
+unsigned int rf_pixel_format_get_bpp(enum rf_pixel_format format);
+size_t
+rf_pixel_format_get_stride(enum rf_pixel_format format, unsigned int width);
+void rf_pixel_format_pack(
+	enum rf_pixel_format format,
+	const uint8_t *p,
+	uint8_t *d
+);
+void rf_region_clear(struct rf_region *region);
+bool rf_region_is_empty(const struct rf_region *region);
+void rf_region_add(struct rf_region *region, const struct rf_rect *rect);
+void rf_region_union(struct rf_region *region, const struct rf_region *other);
+void rf_region_debug(const struct rf_region *region, const char *name);
 
 G_END_DECLS
 
@@ -259,10 +259,45 @@ enum rf_damage_type rf_config_get_damage(RfConfig *this)
 		return RF_DAMAGE_TYPE_GPU;
 	if (g_strcmp0(damage, "cpu") == 0)
 		return RF_DAMAGE_TYPE_CPU;
+	if (g_strcmp0(damage, "auto") == 0)
+		return RF_DAMAGE_TYPE_AUTO;
 	// Empty string or others means dumb.
 	return RF_DAMAGE_TYPE_DUMB;
 }
 
+unsigned int rf_config_get_damage_tile_size(RfConfig *this)
+{
+	g_return_val_if_fail(RF_IS_CONFIG(this), 64);
+
+	g_autoptr(GError) error = NULL;
+	int tile_size = g_key_file_get_integer(
+		this->f, RF_CONFIG_GROUP_REFRAME, "damage-tile-size", &error
+	);
+	if (error != NULL)
+		return 64;
+	if (tile_size < 16 || tile_size > 1024 || tile_size % 4 != 0) {
+		g_warning(
+			"Got invalid damage tile size %d, valid sizes are multiples of 4 between 16 and 1024.",
+			tile_size
+		);
+		tile_size = CLAMP(tile_size / 4 * 4, 16, 1024);
+	}
+	return tile_size;
+}
+
+bool rf_config_get_damage_compute(RfConfig *this)
+{
+	g_return_val_if_fail(RF_IS_CONFIG(this), true);
+
+	g_autoptr(GError) error = NULL;
+	int damage_compute = g_key_file_get_boolean(
+		this->f, RF_CONFIG_GROUP_REFRAME, "damage-compute", &error
+	);
+	if (error != NULL)
+		return true;
+	return damage_compute;
+}
+
 unsigned int rf_config_get_fps(RfConfig *this)
 {
 	g_return_val_if_fail(RF_IS_CONFIG(this), 30);
@@ -276,6 +311,71 @@ unsigned int rf_config_get_fps(RfConfig *this)
 	return fps;
 }
 
+bool rf_config_get_push(RfConfig *this)
+{
+	g_return_val_if_fail(RF_IS_CONFIG(this), false);
+
+	g_autoptr(GError) error = NULL;
+	int push = g_key_file_get_boolean(
+		this->f, RF_CONFIG_GROUP_REFRAME, "push", &error
+	);
+	if (error != NULL)
+		return false;
+	return push;
+}
+
+bool rf_config_get_skip_unchanged(RfConfig *this)
+{
+	g_return_val_if_fail(RF_IS_CONFIG(this), false);
+
+	g_autoptr(GError) error = NULL;
+	int skip_unchanged = g_key_file_get_boolean(
+		this->f, RF_CONFIG_GROUP_REFRAME, "skip-unchanged", &error
+	);
+	if (error != NULL)
+		return false;
+	return skip_unchanged;
+}
+
+bool rf_config_get_writeback(RfConfig *this)
+{
+	g_return_val_if_fail(RF_IS_CONFIG(this), false);
+
+	g_autoptr(GError) error = NULL;
+	int writeback = g_key_file_get_boolean(
+		this->f, RF_CONFIG_GROUP_REFRAME, "writeback", &error
+	);
+	if (error != NULL)
+		return false;
+	return writeback;
+}
+
+bool rf_config_get_async_readback(RfConfig *this)
+{
+	g_return_val_if_fail(RF_IS_CONFIG(this), false);
+
+	g_autoptr(GError) error = NULL;
+	int async_readback = g_key_file_get_boolean(
+		this->f, RF_CONFIG_GROUP_REFRAME, "async-readback", &error
+	);
+	if (error != NULL)
+		return false;
+	return async_readback;
+}
+
+bool rf_config_get_cpu_convert(RfConfig *this)
+{
+	g_return_val_if_fail(RF_IS_CONFIG(this), false);
+
+	g_autoptr(GError) error = NULL;
+	int cpu_convert = g_key_file_get_boolean(
+		this->f, RF_CONFIG_GROUP_REFRAME, "cpu-convert", &error
+	);
+	if (error != NULL)
+		return false;
+	return cpu_convert;
+}
+
 char **rf_config_get_vnc_ip_list(RfConfig *this)
 {
 	g_return_val_if_fail(RF_IS_CONFIG(this), NULL);
@@ -371,6 +471,19 @@ enum rf_vnc_backend rf_config_get_vnc_backend(RfConfig *this)
 	return RF_VNC_BACKEND_LIBVNCSERVER;
 }
 
+bool rf_config_get_vnc_client_cursor(RfConfig *this)
+{
+	g_return_val_if_fail(RF_IS_CONFIG(this), false);
+
+	g_autoptr(GError) error = NULL;
+	int client_cursor = g_key_file_get_boolean(
+		this->f, RF_CONFIG_GROUP_VNC, "client-cursor", &error
+	);
+	if (error != NULL)
+		return false;
+	return client_cursor;
+}
+
 char *rf_config_get_neatvnc_username(RfConfig *this)
 {
 	g_return_val_if_fail(RF_IS_CONFIG(this), NULL);
@@ -11,7 +11,8 @@ enum rf_wakeup_device { RF_WAKEUP_DEVICE_KEYBOARD, RF_WAKEUP_DEVICE_POINTER };
 enum rf_damage_type {
 	RF_DAMAGE_TYPE_DUMB,
 	RF_DAMAGE_TYPE_CPU,
-	RF_DAMAGE_TYPE_GPU
+	RF_DAMAGE_TYPE_GPU,
+	RF_DAMAGE_TYPE_AUTO
 };
 
 enum rf_vnc_backend { RF_VNC_BACKEND_LIBVNCSERVER, RF_VNC_BACKEND_NEATVNC };
@@ -35,11 +36,19 @@ bool rf_config_get_cursor(RfConfig *this);
 bool rf_config_get_wakeup(RfConfig *this);
 enum rf_wakeup_device rf_config_get_wakeup_device(RfConfig *this);
 enum rf_damage_type rf_config_get_damage(RfConfig *this);
+unsigned int rf_config_get_damage_tile_size(RfConfig *this);
+bool rf_config_get_damage_compute(RfConfig *this);
 unsigned int rf_config_get_fps(RfConfig *this);
+bool rf_config_get_push(RfConfig *this);
+bool rf_config_get_skip_unchanged(RfConfig *this);
+bool rf_config_get_writeback(RfConfig *this);
+bool rf_config_get_async_readback(RfConfig *this);
+bool rf_config_get_cpu_convert(RfConfig *this);
 char **rf_config_get_vnc_ip_list(RfConfig *this);
 unsigned int rf_config_get_vnc_port(RfConfig *this);
 char *rf_config_get_vnc_password(RfConfig *this);
 enum rf_vnc_backend rf_config_get_vnc_backend(RfConfig *this);
+bool rf_config_get_vnc_client_cursor(RfConfig *this);
 char *rf_config_get_neatvnc_username(RfConfig *this);
 bool rf_config_get_neatvnc_allow_broken_crypto(RfConfig *this);
 char *rf_config_get_neatvnc_rsa_private_key_file(RfConfig *this);
@@ -22,6 +22,20 @@ struct this {
 	unsigned int rotation;
 	double aspect_ratio;
 	bool skip_damage;
+	bool client_cursor;
+	// Cursor sent to VNC, rect is in VNC coordinates.
+	bool has_cursor;
+	struct rf_buffer_metadata cursor_md;
+	struct rf_rect cursor_rect;
+	unsigned int hotspot_x;
+	unsigned int hotspot_y;
+	double pointer_rx;
+	double pointer_ry;
+	// Checks for frames that are still being read back from GPU, only if
+	// Streamer does not send the next frame to collect them.
+	unsigned int readback_id;
+	// In milliseconds.
+	unsigned int readback_interval;
 };
 
 static void on_resize_event(RfVNCServer *v, int width, int height, void *data)
@@ -36,6 +50,178 @@ static void on_resize_event(RfVNCServer *v, int width, int height, void *data)
 		this->width = width;
 		this->height = width / this->aspect_ratio;
 	}
+	// Streamer may skip unchanged frames, but we need to convert with the
+	// new size.
+	rf_streamer_refresh(this->streamer);
+}
+
+static void on_pointer_event(
+	RfVNCServer *v,
+	double rx,
+	double ry,
+	bool left,
+	bool middle,
+	bool right,
+	bool back,
+	bool forward,
+	bool wup,
+	bool wdown,
+	bool wleft,
+	bool wright,
+	void *data
+)
+{
+	struct this *this = data;
+
+	this->pointer_rx = rx;
+	this->pointer_ry = ry;
+}
+
+// Frames are rotated clockwise by converter, so we do the same to cursor rect.
+static void map_cursor_rect(
+	struct this *this,
+	const struct rf_buffer_metadata *md,
+	struct rf_rect *rect
+)
+{
+	const double x1 = (double)md->crtc_x / md->crtc_width;
+	const double y1 = (double)md->crtc_y / md->crtc_height;
+	const double x2 = (double)(md->crtc_x + (int)md->crtc_w) /
+			  md->crtc_width;
+	const double y2 = (double)(md->crtc_y + (int)md->crtc_h) /
+			  md->crtc_height;
+	double rx1 = x1;
+	double ry1 = y1;
+	double rx2 = x2;
+	double ry2 = y2;
+	switch (this->rotation) {
+	case 90:
+		rx1 = 1 - y2;
+		ry1 = x1;
+		rx2 = 1 - y1;
+		ry2 = x2;
+		break;
+	case 180:
+		rx1 = 1 - x2;
+		ry1 = 1 - y2;
+		rx2 = 1 - x1;
+		ry2 = 1 - y1;
+		break;
+	case 270:
+		rx1 = y1;
+		ry1 = 1 - x2;
+		rx2 = y2;
+		ry2 = 1 - x1;
+		break;
+	default:
+		break;
+	}
+	rect->x = rx1 * this->width;
+	rect->y = ry1 * this->height;
+	rect->w = MAX(1, (rx2 - rx1) * this->width);
+	rect->h = MAX(1, (ry2 - ry1) * this->height);
+}
+
+static inline bool is_same_cursor(
+	const struct rf_buffer_metadata *a,
+	const struct rf_buffer_metadata *b
+)
+{
+	return b->cached && a->slot == b->slot && a->fb_id == b->fb_id &&
+	       a->src_x == b->src_x && a->src_y == b->src_y &&
+	       a->src_w == b->src_w && a->src_h == b->src_h &&
+	       a->crtc_w == b->crtc_w && a->crtc_h == b->crtc_h;
+}
+
+// Only read cursor back if its shape changes, moving cursor only sends the new
+// position.
+static void update_cursor(struct this *this, const struct rf_buffer *cursor)
+{
+	if (cursor == NULL) {
+		if (this->has_cursor)
+			rf_vnc_server_update_cursor(
+				this->vnc, NULL, 0, 0, 0, 0
+			);
+		this->has_cursor = false;
+		return;
+	}
+
+	struct rf_rect rect;
+	map_cursor_rect(this, &cursor->md, &rect);
+
+	const bool reshaped = !this->has_cursor ||
+			      !is_same_cursor(&this->cursor_md, &cursor->md) ||
+			      rect.w != this->cursor_rect.w ||
+			      rect.h != this->cursor_rect.h;
+	if (reshaped) {
+		GByteArray *buf = rf_converter_convert_cursor(
+			this->converter, cursor, rect.w, rect.h
+		);
+		if (buf == NULL)
+			return;
+		// DRM does not tell us the hotspot, but compositors put cursor
+		// plane at pointer position minus hotspot, so guess it from
+		// where the client put the pointer.
+		const int px = this->pointer_rx * this->width - rect.x;
+		const int py = this->pointer_ry * this->height - rect.y;
+		if (px >= 0 && px < (int)rect.w && py >= 0 &&
+		    py < (int)rect.h) {
+			this->hotspot_x = px;
+			this->hotspot_y = py;
+		} else {
+			this->hotspot_x = 0;
+			this->hotspot_y = 0;
+		}
+		g_debug("Frame: Got cursor width %u, height %u, hotspot x %u and y %u.",
+			rect.w,
+			rect.h,
+			this->hotspot_x,
+			this->hotspot_y);
+		rf_vnc_server_update_cursor(
+			this->vnc,
+			buf,
+			rect.w,
+			rect.h,
+			this->hotspot_x,
+			this->hotspot_y
+		);
+		this->has_cursor = true;
+	}
+	this->cursor_md = cursor->md;
+
+	if (reshaped || rect.x != this->cursor_rect.x ||
+	    rect.y != this->cursor_rect.y)
+		rf_vnc_server_move_cursor(
+			this->vnc,
+			rect.x + (int)this->hotspot_x,
+			rect.y + (int)this->hotspot_y
+		);
+	this->cursor_rect = rect;
+}
+
+static int on_readback(void *data)
+{
+	struct this *this = data;
+
+	struct rf_region damage;
+	g_autoptr(GBytes) buf = rf_converter_collect(
+		this->converter,
+		this->width,
+		this->height,
+		this->skip_damage ? NULL : &damage
+	);
+	if (buf != NULL)
+		rf_vnc_server_update(
+			this->vnc,
+			buf,
+			this->width,
+			this->height,
+			this->skip_damage ? NULL : &damage
+		);
+	if (rf_converter_has_pending(this->converter))
+		return G_SOURCE_CONTINUE;
+	this->readback_id = 0;
+	return G_SOURCE_REMOVE;
 }
 
 static void
@@ -63,8 +249,26 @@ on_frame(RfStreamer *s, size_t length, const struct rf_buffer *bufs, void *data)
 		}
 	}
 
-	struct rf_rect damage;
-	GByteArray *buf = rf_converter_convert(
+	// Clients draw cursor themselves, so we don't draw it into frames. If
+	// the primary plane is unchanged, only the cursor moved.
+	if (this->client_cursor) {
+		update_cursor(this, length > 1 ? &bufs[1] : NULL);
+		length = 1;
+		if (primary->md.unchanged) {
+			rf_vnc_server_update(
+				this->vnc, NULL, this->width, this->height, NULL
+			);
+			return;
+		}
+	}
+
+	// Frames are packed into the pixel format clients want, so VNC server
+	// won't translate them.
+	rf_converter_set_pixel_format(
+		this->converter, rf_vnc_server_get_pixel_format(this->vnc)
+	);
+	struct rf_region damage;
+	g_autoptr(GBytes) buf = rf_converter_convert(
 		this->converter,
 		length,
 		bufs,
@@ -79,6 +283,19 @@ on_frame(RfStreamer *s, size_t length, const struct rf_buffer *bufs, void *data)
 		this->height,
 		this->skip_damage ? NULL : &damage
 	);
+	// Pending frames are collected by converting the next frame, but
+	// Streamer may not send it if nothing changed, so we check them once
+	// per frame interval ourselves.
+	if (!rf_converter_has_pending(this->converter)) {
+		if (this->readback_id != 0) {
+			g_source_remove(this->readback_id);
+			this->readback_id = 0;
+		}
+	} else if (this->readback_id == 0) {
+		this->readback_id = g_timeout_add(
+			this->readback_interval, on_readback, this
+		);
+	}
 }
 
 static void on_first_client(RfVNCServer *v, void *data)
@@ -90,6 +307,14 @@ static void on_first_client(RfVNCServer *v, void *data)
 	this->height = rf_config_get_default_height(this->config);
 	// We always recalculate this on frame so here is not important.
 	this->aspect_ratio = 1.0;
+	this->client_cursor = rf_config_get_vnc_client_cursor(this->config);
+	this->readback_interval =
+		1000 / MAX(rf_config_get_fps(this->config), 1);
+	if (this->client_cursor && !rf_config_get_cursor(this->config))
+		g_warning(
+			"VNC: Client cursor requires cursor plane, but it is disabled."
+		);
+	this->has_cursor = false;
 
 	if (rf_streamer_start(this->streamer) < 0)
 		rf_vnc_server_flush(this->vnc);
@@ -99,6 +324,10 @@ static void on_last_client(RfVNCServer *v, void *data)
 {
 	struct this *this = data;
 
+	if (this->readback_id != 0) {
+		g_source_remove(this->readback_id);
+		this->readback_id = 0;
+	}
 	rf_converter_stop(this->converter);
 	rf_streamer_stop(this->streamer);
 }
@@ -286,6 +515,9 @@ int main(int argc, char *argv[])
 		G_CALLBACK(rf_streamer_send_keyboard_event),
 		this->streamer
 	);
+	g_signal_connect(
+		this->vnc, "pointer-event", G_CALLBACK(on_pointer_event), this
+	);
 	g_signal_connect_swapped(
 		this->vnc,
 		"pointer-event",
@@ -1,3 +1,11 @@
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/dma-buf.h>
 #include <epoxy/egl.h>
 #include <epoxy/gl.h>
 #include <libdrm/drm_fourcc.h>
@@ -9,6 +17,51 @@
 #include "rf-converter.h"
 
 #define GL_MAX_BUFFERS 3
+// Each cached image keeps its framebuffer alive, so don't keep too many more
+// than slots.
+#define MAX_IMAGES (RF_MAX_SLOTS + 4)
+// One is being read back, one is being drawn, and one more for GPU hiccups.
+#define MAX_READBACKS 3
+// GLSL ES v1 needs a constant loop bound for GPU damage region detection.
+#define MAX_TILE_SIZE 16
+// Compute shader checks a group of 8x8 tiles together.
+#define COMPUTE_GROUP_SIZE 8
+
+// Streamer only tells us slots, but it may register the same framebuffer again
+// after evicting it or reconnecting, so we identify framebuffers by dma-buf
+// inode and layout. An image keeps the dma-buf alive, so the inode won't be
+// reused by another dma-buf while it is cached.
+struct image {
+	ino_t ino;
+	uint32_t fourcc;
+	uint32_t width;
+	uint32_t height;
+	uint64_t modifier;
+	unsigned int length;
+	uint32_t offsets[RF_MAX_FDS];
+	uint32_t pitches[RF_MAX_FDS];
+	EGLImage image;
+	unsigned int texture;
+	uint64_t used;
+};
+
+struct readback {
+	unsigned int buffer;
+	GLsync fence;
+	// Damage clips against the previous drawn frame, if we got them.
+	bool has_clips;
+	struct rf_region clips;
+};
+
+// Pool keeps a reference of each frame, and each GBytes handed out keeps one,
+// so a frame only referenced by pool is free to be written.
+struct frame {
+	gatomicrefcount ref;
+	uint8_t *data;
+	// Holds a whole frame, which misses `pending` damage of newer frames.
+	bool valid;
+	struct rf_region pending;
+};
 
 struct _RfConverter {
 	GObject parent_instance;
@@ -17,27 +70,78 @@ struct _RfConverter {
 	unsigned int gles_major;
 	EGLDisplay display;
 	EGLContext context;
-	GByteArray *curr;
-	GByteArray *prev;
+	// Frames are written into free buffers of the pool, so VNC servers
+	// could keep encoding the previous one, and we compare with it by
+	// pointer instead of copying.
+	GPtrArray *frames;
+	struct frame *curr;
+	struct frame *prev;
+	GByteArray *cursor;
 	unsigned int width;
 	unsigned int height;
 	unsigned int prev_width;
 	unsigned int prev_height;
 	unsigned int damage_width;
 	unsigned int damage_height;
+	unsigned int cursor_width;
+	unsigned int cursor_height;
+	// Cursor rect on monitor in the previous frame, cursor moving damages
+	// both old and new rects.
+	struct rf_rect prev_cursor_rect;
+	// Previous frame is the last one that clients got, so damage clips from
+	// compositor could be used.
+	bool prev_valid;
 	unsigned int buffers[GL_MAX_BUFFERS];
 	unsigned int draw_vertex_array;
 	unsigned int damage_vertex_array;
+	unsigned int format_vertex_array;
 	unsigned int draw_program;
 	unsigned int damage_program;
+	// GLES v3.1 compute shader only writes damaged tiles into a buffer, so
+	// we don't need to read back and scan all tiles.
+	unsigned int compute_program;
+	unsigned int tile_buffer;
+	// Frames are packed into the pixel format clients want, so we read back
+	// less and clients don't translate them. Rows of packed frames are in
+	// RGBA texels.
+	unsigned int format_program;
+	enum rf_pixel_format next_format;
+	enum rf_pixel_format format;
+	unsigned int format_width;
+	size_t stride;
 	unsigned int draw_framebuffer;
 	unsigned int damage_framebuffer;
+	unsigned int format_framebuffer;
 	unsigned int curr_texture;
 	unsigned int prev_texture;
 	unsigned int damage_texture;
+	unsigned int format_texture;
+	unsigned int cursor_texture;
+	// Imported framebuffers, evicted in LRU order.
+	struct image images[MAX_IMAGES];
+	uint64_t n_image_uses;
+	// Index of image for each slot, -1 if unknown.
+	int slot_images[RF_MAX_SLOTS];
+	// Frames are read back into pixel pack buffers in order, and only
+	// copied out after GPU finished them, so we never wait for GPU.
+	bool async_readback;
+	struct readback readbacks[MAX_READBACKS];
+	unsigned int readback_head;
+	unsigned int n_readbacks;
+	// A frame failed to be copied out, clips of later frames miss it.
+	bool readback_lost;
 	unsigned int tile_size;
+	// Tile size of CPU damage region detection, from config.
+	unsigned int cpu_tile_size;
 	unsigned int rotation;
 	enum rf_damage_type damage_type;
+	// Whether we could make GPU wait for rendering fences of framebuffers.
+	bool native_fence;
+	// Linear framebuffers are mapped and drawn on CPU, without EGL or GL.
+	bool cpu;
+	// Frame drawn on CPU is in RGBA, it is packed into current buffer if
+	// clients want another pixel format.
+	GByteArray *canvas;
 	bool running;
 };
 G_DEFINE_TYPE(RfConverter, rf_converter, G_TYPE_OBJECT)
@@ -165,6 +269,22 @@ static int setup_egl(RfConverter *this)
 		return -3;
 	}
 
+#ifdef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+	this->native_fence = epoxy_has_egl_extension(
+				     this->display,
+				     "EGL_ANDROID_native_fence_sync"
+			     ) &&
+			     epoxy_has_egl_extension(
+				     this->display, "EGL_KHR_wait_sync"
+			     );
+#else
+	this->native_fence = false;
+#endif
+	g_message(
+		"EGL: Waiting for framebuffer fences on GPU is %s.",
+		this->native_fence ? "enabled" : "disabled"
+	);
+
 	return 0;
 }
 
@@ -239,41 +359,60 @@ static unsigned int make_program(const char *vs, const char *fs)
 	return program;
 }
 
-static void bind_buffers(RfConverter *this, unsigned int program)
+static unsigned int make_compute_program(const char *cs)
 {
-	glBindBuffer(GL_ARRAY_BUFFER, this->buffers[0]);
-	glVertexAttribPointer(
-		glGetAttribLocation(program, "in_position"),
-		2,
-		GL_FLOAT,
-		GL_FALSE,
-		2 * sizeof(float),
-		0
-	);
-	glEnableVertexAttribArray(glGetAttribLocation(program, "in_position"));
+	unsigned int c = make_shader(GL_COMPUTE_SHADER, cs);
+	if (c == 0)
+		return 0;
+	unsigned int program = glCreateProgram();
+	if (program == 0)
+		return 0;
+	glAttachShader(program, c);
+	glLinkProgram(program);
+	glDeleteShader(c);
+	int linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (linked == 0) {
+		glDeleteProgram(program);
+		g_warning("GL: Failed to link program.");
+		return 0;
+	}
+	return program;
+}
 
-	glBindBuffer(GL_ARRAY_BUFFER, this->buffers[1]);
+// Linker drops attributes that shaders don't use, and their locations are -1.
+static inline void
+bind_attrib(unsigned int program, const char *name, unsigned int buffer)
+{
+	const int location = glGetAttribLocation(program, name);
+	if (location < 0)
+		return;
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
 	glVertexAttribPointer(
-		glGetAttribLocation(program, "in_coordinate"),
-		2,
-		GL_FLOAT,
-		GL_FALSE,
-		2 * sizeof(float),
-		0
+		location, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), 0
 	);
-	glEnableVertexAttribArray(glGetAttribLocation(program, "in_coordinate"));
+	glEnableVertexAttribArray(location);
+}
+
+static inline void unbind_attrib(unsigned int program, const char *name)
+{
+	const int location = glGetAttribLocation(program, name);
+	if (location >= 0)
+		glDisableVertexAttribArray(location);
+}
 
+static void bind_buffers(RfConverter *this, unsigned int program)
+{
+	bind_attrib(program, "in_position", this->buffers[0]);
+	bind_attrib(program, "in_coordinate", this->buffers[1]);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->buffers[2]);
 }
 
 static void unbind_buffers(RfConverter *this, unsigned int program)
 {
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glDisableVertexAttribArray(glGetAttribLocation(program, "in_position"));
-
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glDisableVertexAttribArray(glGetAttribLocation(program, "in_coordinate"));
-
+	unbind_attrib(program, "in_position");
+	unbind_attrib(program, "in_coordinate");
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
@@ -328,22 +467,75 @@ static int setup_gl(RfConverter *this)
 			"	out_color = texture(image, out_coordinate.xy);\n"
 			"}\n";
 		this->draw_program = make_program(vs, draw_fs);
+		// Each fragment is a tile, it compares every pixel in the
+		// tile, so no change is missed.
 		const char damage_fs[] =
 			"#version 300 es\n"
 			"precision highp float;\n"
+			"precision highp int;\n"
 			"uniform sampler2D curr;\n"
 			"uniform sampler2D prev;\n"
-			"in vec2 pass_coordinate;\n"
+			"uniform int tile_size;\n"
 			"out vec4 out_color;\n"
 			"void main() {\n"
-			"	vec4 currp = texture(curr, pass_coordinate);\n"
-			"	vec4 prevp = texture(prev, pass_coordinate);\n"
-			"	if (any(notEqual(currp, prevp)))\n"
-			"		out_color = vec4(1.0f, 1.0f, 1.0f, 1.0f);\n"
-			"	else\n"
-			"		out_color = vec4(0.0f, 0.0f, 0.0f, 1.0f);\n"
+			"	ivec2 begin = ivec2(gl_FragCoord.xy) * tile_size;\n"
+			"	ivec2 end = min(begin + tile_size, textureSize(curr, 0));\n"
+			"	for (int y = begin.y; y < end.y; ++y) {\n"
+			"		for (int x = begin.x; x < end.x; ++x) {\n"
+			"			vec4 currp = texelFetch(curr, ivec2(x, y), 0);\n"
+			"			vec4 prevp = texelFetch(prev, ivec2(x, y), 0);\n"
+			"			if (any(notEqual(currp, prevp))) {\n"
+			"				out_color = vec4(1.0f, 1.0f, 1.0f, 1.0f);\n"
+			"				return;\n"
+			"			}\n"
+			"		}\n"
+			"	}\n"
+			"	out_color = vec4(0.0f, 0.0f, 0.0f, 1.0f);\n"
 			"}\n";
 		this->damage_program = make_program(vs, damage_fs);
+		// Each texel holds as many pixels as it could.
+		const char format_fs[] =
+			"#version 300 es\n"
+			"precision highp float;\n"
+			"uniform sampler2D image;\n"
+			"uniform int pixels;\n"
+			"uniform vec2 size;\n"
+			"out vec4 out_color;\n"
+			"vec3 get_pixel(float x, float y) {\n"
+			"	if (x >= size.x)\n"
+			"		return vec3(0.0f);\n"
+			"	return texture(image, vec2(x + 0.5f, y + 0.5f) / size).rgb;\n"
+			"}\n"
+			"vec2 pack_rgb565(vec3 c) {\n"
+			"	vec3 v = floor(c * vec3(31.0f, 63.0f, 31.0f) + 0.5f);\n"
+			"	float low = mod(v.g, 8.0f) * 32.0f + v.b;\n"
+			"	float high = v.r * 8.0f + floor(v.g / 8.0f);\n"
+			"	return vec2(low, high) / 255.0f;\n"
+			"}\n"
+			"float pack_bgr233(vec3 c) {\n"
+			"	vec3 v = floor(c * vec3(7.0f, 7.0f, 3.0f) + 0.5f);\n"
+			"	return (v.b * 64.0f + v.g * 8.0f + v.r) / 255.0f;\n"
+			"}\n"
+			"void main() {\n"
+			"	vec2 p = floor(gl_FragCoord.xy);\n"
+			"	float x = p.x * float(pixels);\n"
+			"	if (pixels == 1) {\n"
+			"		out_color = vec4(get_pixel(x, p.y).bgr, 1.0f);\n"
+			"	} else if (pixels == 2) {\n"
+			"		out_color = vec4(\n"
+			"			pack_rgb565(get_pixel(x, p.y)),\n"
+			"			pack_rgb565(get_pixel(x + 1.0f, p.y))\n"
+			"		);\n"
+			"	} else {\n"
+			"		out_color = vec4(\n"
+			"			pack_bgr233(get_pixel(x, p.y)),\n"
+			"			pack_bgr233(get_pixel(x + 1.0f, p.y)),\n"
+			"			pack_bgr233(get_pixel(x + 2.0f, p.y)),\n"
+			"			pack_bgr233(get_pixel(x + 3.0f, p.y))\n"
+			"		);\n"
+			"	}\n"
+			"}\n";
+		this->format_program = make_program(vs, format_fs);
 	} else {
 		const char vs[] =
 			"#version 100\n"
@@ -367,26 +559,86 @@ static int setup_gl(RfConverter *this)
 			"	gl_FragColor = texture2D(image, out_coordinate.xy);\n"
 			"}\n";
 		this->draw_program = make_program(vs, draw_fs);
+		// GLSL ES v1 only allows loops with constant bounds, so we
+		// break at the uniform tile size. There is no `texelFetch()`,
+		// so we sample at texel centers.
 		const char damage_fs[] =
 			"#version 100\n"
+			"#define MAX_TILE_SIZE " G_STRINGIFY(MAX_TILE_SIZE) "\n"
 			"precision highp float;\n"
 			"uniform sampler2D curr;\n"
 			"uniform sampler2D prev;\n"
-			"varying vec2 pass_coordinate;\n"
+			"uniform int tile_size;\n"
+			"uniform vec2 size;\n"
 			"void main() {\n"
-			"	vec4 currp = texture2D(curr, pass_coordinate);\n"
-			"	vec4 prevp = texture2D(prev, pass_coordinate);\n"
-			"	if (any(notEqual(currp, prevp)))\n"
-			"		gl_FragColor = vec4(1.0, 1.0, 1.0, 1.0);\n"
-			"	else\n"
-			"		gl_FragColor = vec4(0.0, 0.0, 0.0, 1.0);\n"
+			"	vec2 begin = floor(gl_FragCoord.xy) * float(tile_size);\n"
+			"	for (int y = 0; y < MAX_TILE_SIZE; ++y) {\n"
+			"		if (y >= tile_size)\n"
+			"			break;\n"
+			"		for (int x = 0; x < MAX_TILE_SIZE; ++x) {\n"
+			"			if (x >= tile_size)\n"
+			"				break;\n"
+			"			vec2 p = min(begin + vec2(x, y), size - 1.0);\n"
+			"			vec2 coordinate = (p + 0.5) / size;\n"
+			"			vec4 currp = texture2D(curr, coordinate);\n"
+			"			vec4 prevp = texture2D(prev, coordinate);\n"
+			"			if (any(notEqual(currp, prevp))) {\n"
+			"				gl_FragColor = vec4(1.0, 1.0, 1.0, 1.0);\n"
+			"				return;\n"
+			"			}\n"
+			"		}\n"
+			"	}\n"
+			"	gl_FragColor = vec4(0.0, 0.0, 0.0, 1.0);\n"
 			"}\n";
 		this->damage_program = make_program(vs, damage_fs);
+		const char format_fs[] =
+			"#version 100\n"
+			"precision highp float;\n"
+			"uniform sampler2D image;\n"
+			"uniform int pixels;\n"
+			"uniform vec2 size;\n"
+			"vec3 get_pixel(float x, float y) {\n"
+			"	if (x >= size.x)\n"
+			"		return vec3(0.0);\n"
+			"	return texture2D(image, vec2(x + 0.5, y + 0.5) / size).rgb;\n"
+			"}\n"
+			"vec2 pack_rgb565(vec3 c) {\n"
+			"	vec3 v = floor(c * vec3(31.0, 63.0, 31.0) + 0.5);\n"
+			"	float low = mod(v.g, 8.0) * 32.0 + v.b;\n"
+			"	float high = v.r * 8.0 + floor(v.g / 8.0);\n"
+			"	return vec2(low, high) / 255.0;\n"
+			"}\n"
+			"float pack_bgr233(vec3 c) {\n"
+			"	vec3 v = floor(c * vec3(7.0, 7.0, 3.0) + 0.5);\n"
+			"	return (v.b * 64.0 + v.g * 8.0 + v.r) / 255.0;\n"
+			"}\n"
+			"void main() {\n"
+			"	vec2 p = floor(gl_FragCoord.xy);\n"
+			"	float x = p.x * float(pixels);\n"
+			"	if (pixels == 1) {\n"
+			"		gl_FragColor = vec4(get_pixel(x, p.y).bgr, 1.0);\n"
+			"	} else if (pixels == 2) {\n"
+			"		gl_FragColor = vec4(\n"
+			"			pack_rgb565(get_pixel(x, p.y)),\n"
+			"			pack_rgb565(get_pixel(x + 1.0, p.y))\n"
+			"		);\n"
+			"	} else {\n"
+			"		gl_FragColor = vec4(\n"
+			"			pack_bgr233(get_pixel(x, p.y)),\n"
+			"			pack_bgr233(get_pixel(x + 1.0, p.y)),\n"
+			"			pack_bgr233(get_pixel(x + 2.0, p.y)),\n"
+			"			pack_bgr233(get_pixel(x + 3.0, p.y))\n"
+			"		);\n"
+			"	}\n"
+			"}\n";
+		this->format_program = make_program(vs, format_fs);
 	}
 	if (this->draw_program == 0)
 		return -5;
 	if (this->damage_program == 0)
 		return -6;
+	if (this->format_program == 0)
+		return -7;
 
 	glUseProgram(this->draw_program);
 	// Use texture 0 for this sampler. This only needs to be done once.
@@ -398,6 +650,63 @@ static int setup_gl(RfConverter *this)
 	glUniform1i(glGetUniformLocation(this->damage_program, "prev"), 1);
 	glUseProgram(0);
 
+	glUseProgram(this->format_program);
+	glUniform1i(glGetUniformLocation(this->format_program, "image"), 0);
+	glUseProgram(0);
+
+	// Each invocation is a tile, damaged tiles are appended as `y << 16 |
+	// x` in any order.
+	if (epoxy_gl_version() >= 31 &&
+	    rf_config_get_damage_compute(this->config)) {
+		const char damage_cs[] =
+			"#version 310 es\n"
+			"#define GROUP_SIZE " G_STRINGIFY(COMPUTE_GROUP_SIZE) "\n"
+			"layout(local_size_x = GROUP_SIZE, local_size_y = GROUP_SIZE) in;\n"
+			"precision highp float;\n"
+			"precision highp int;\n"
+			"uniform highp sampler2D curr;\n"
+			"uniform highp sampler2D prev;\n"
+			"uniform int tile_size;\n"
+			"layout(std430, binding = 0) buffer damage {\n"
+			"	uint n_tiles;\n"
+			"	uint tiles[];\n"
+			"};\n"
+			"void main() {\n"
+			"	ivec2 tile = ivec2(gl_GlobalInvocationID.xy);\n"
+			"	ivec2 size = textureSize(curr, 0);\n"
+			"	ivec2 begin = tile * tile_size;\n"
+			"	if (any(greaterThanEqual(begin, size)))\n"
+			"		return;\n"
+			"	ivec2 end = min(begin + tile_size, size);\n"
+			"	for (int y = begin.y; y < end.y; ++y) {\n"
+			"		for (int x = begin.x; x < end.x; ++x) {\n"
+			"			vec4 currp = texelFetch(curr, ivec2(x, y), 0);\n"
+			"			vec4 prevp = texelFetch(prev, ivec2(x, y), 0);\n"
+			"			if (any(notEqual(currp, prevp))) {\n"
+			"				uint i = atomicAdd(n_tiles, 1u);\n"
+			"				tiles[i] = uint(tile.y) << 16 | uint(tile.x);\n"
+			"				return;\n"
+			"			}\n"
+			"		}\n"
+			"	}\n"
+			"}\n";
+		this->compute_program = make_compute_program(damage_cs);
+	}
+	if (this->compute_program != 0) {
+		glUseProgram(this->compute_program);
+		glUniform1i(
+			glGetUniformLocation(this->compute_program, "curr"), 0
+		);
+		glUniform1i(
+			glGetUniformLocation(this->compute_program, "prev"), 1
+		);
+		glUseProgram(0);
+	}
+	g_message(
+		"GL: Compute shader for damage region detection is %s.",
+		this->compute_program != 0 ? "enabled" : "disabled"
+	);
+
 	glGenBuffers(GL_MAX_BUFFERS, this->buffers);
 
 	// clang-format off
@@ -459,16 +768,30 @@ static int setup_gl(RfConverter *this)
 		glBindVertexArray(this->damage_vertex_array);
 		bind_buffers(this, this->damage_program);
 		glBindVertexArray(0);
+
+		glGenVertexArrays(1, &this->format_vertex_array);
+		glBindVertexArray(this->format_vertex_array);
+		bind_buffers(this, this->format_program);
+		glBindVertexArray(0);
 	}
 
 	glGenFramebuffers(1, &this->draw_framebuffer);
 	glGenFramebuffers(1, &this->damage_framebuffer);
+	glGenFramebuffers(1, &this->format_framebuffer);
 
 	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
 	return 0;
 }
 
+static inline void clean_fence(struct readback *r)
+{
+	if (r->fence != NULL) {
+		glDeleteSync(r->fence);
+		r->fence = NULL;
+	}
+}
+
 static void clean_gl(RfConverter *this)
 {
 	if (this->buffers[0] != 0) {
@@ -485,6 +808,10 @@ static void clean_gl(RfConverter *this)
 		glDeleteVertexArrays(1, &this->damage_vertex_array);
 		this->damage_vertex_array = 0;
 	}
+	if (this->format_vertex_array != 0) {
+		glDeleteVertexArrays(1, &this->format_vertex_array);
+		this->format_vertex_array = 0;
+	}
 	if (this->draw_program != 0) {
 		glDeleteProgram(this->draw_program);
 		this->draw_program = 0;
@@ -493,6 +820,18 @@ static void clean_gl(RfConverter *this)
 		glDeleteProgram(this->damage_program);
 		this->damage_program = 0;
 	}
+	if (this->compute_program != 0) {
+		glDeleteProgram(this->compute_program);
+		this->compute_program = 0;
+	}
+	if (this->tile_buffer != 0) {
+		glDeleteBuffers(1, &this->tile_buffer);
+		this->tile_buffer = 0;
+	}
+	if (this->format_program != 0) {
+		glDeleteProgram(this->format_program);
+		this->format_program = 0;
+	}
 	if (this->draw_framebuffer != 0) {
 		glDeleteFramebuffers(1, &this->draw_framebuffer);
 		this->draw_framebuffer = 0;
@@ -501,6 +840,10 @@ static void clean_gl(RfConverter *this)
 		glDeleteFramebuffers(1, &this->damage_framebuffer);
 		this->damage_framebuffer = 0;
 	}
+	if (this->format_framebuffer != 0) {
+		glDeleteFramebuffers(1, &this->format_framebuffer);
+		this->format_framebuffer = 0;
+	}
 	if (this->curr_texture != 0) {
 		glDeleteTextures(1, &this->curr_texture);
 		this->curr_texture = 0;
@@ -513,6 +856,70 @@ static void clean_gl(RfConverter *this)
 		glDeleteTextures(1, &this->damage_texture);
 		this->damage_texture = 0;
 	}
+	if (this->format_texture != 0) {
+		glDeleteTextures(1, &this->format_texture);
+		this->format_texture = 0;
+	}
+	if (this->cursor_texture != 0) {
+		glDeleteTextures(1, &this->cursor_texture);
+		this->cursor_texture = 0;
+	}
+	for (int i = 0; i < MAX_READBACKS; ++i) {
+		struct readback *r = &this->readbacks[i];
+		clean_fence(r);
+		if (r->buffer != 0) {
+			glDeleteBuffers(1, &r->buffer);
+			r->buffer = 0;
+		}
+	}
+	this->readback_head = 0;
+	this->n_readbacks = 0;
+}
+
+static void clean_image(RfConverter *this, int i)
+{
+	struct image *image = &this->images[i];
+	if (image->texture != 0) {
+		glDeleteTextures(1, &image->texture);
+		image->texture = 0;
+	}
+	if (image->image != EGL_NO_IMAGE) {
+		eglDestroyImage(this->display, image->image);
+		image->image = EGL_NO_IMAGE;
+	}
+	image->ino = 0;
+	image->used = 0;
+	for (unsigned int j = 0; j < RF_MAX_SLOTS; ++j)
+		if (this->slot_images[j] == i)
+			this->slot_images[j] = -1;
+}
+
+static void clean_images(RfConverter *this)
+{
+	for (int i = 0; i < MAX_IMAGES; ++i)
+		clean_image(this, i);
+	this->n_image_uses = 0;
+}
+
+static struct frame *new_frame(size_t size)
+{
+	struct frame *f = g_new0(struct frame, 1);
+	g_atomic_ref_count_init(&f->ref);
+	// Padding of packed rows is never written on CPU.
+	f->data = g_malloc0(size);
+	f->valid = false;
+	rf_region_clear(&f->pending);
+	return f;
+}
+
+// VNC servers may drop frames in their encoding threads.
+static void unref_frame(void *data)
+{
+	struct frame *f = data;
+	if (!g_atomic_ref_count_dec(&f->ref))
+		return;
+	g_free(f->data);
+	g_free(f);
 }
 
 static void finalize(GObject *o)
@@ -538,29 +945,70 @@ static void rf_converter_init(RfConverter *this)
 	this->gles_major = 3;
 	this->display = EGL_NO_DISPLAY;
 	this->context = EGL_NO_CONTEXT;
+	this->frames = NULL;
 	this->curr = NULL;
 	this->prev = NULL;
+	this->cursor = NULL;
 	this->width = 0;
 	this->height = 0;
 	this->prev_width = 0;
 	this->prev_height = 0;
 	this->damage_width = 0;
 	this->damage_height = 0;
+	this->cursor_width = 0;
+	this->cursor_height = 0;
+	this->prev_cursor_rect.x = 0;
+	this->prev_cursor_rect.y = 0;
+	this->prev_cursor_rect.w = 0;
+	this->prev_cursor_rect.h = 0;
+	this->prev_valid = false;
 	this->buffers[0] = 0;
 	this->buffers[1] = 0;
 	this->buffers[2] = 0;
 	this->draw_vertex_array = 0;
 	this->damage_vertex_array = 0;
+	this->format_vertex_array = 0;
 	this->draw_program = 0;
 	this->damage_program = 0;
+	this->compute_program = 0;
+	this->tile_buffer = 0;
+	this->format_program = 0;
+	this->next_format = RF_PIXEL_FORMAT_RGBX8888;
+	this->format = RF_PIXEL_FORMAT_RGBX8888;
+	this->format_width = 0;
+	this->stride = 0;
 	this->draw_framebuffer = 0;
 	this->damage_framebuffer = 0;
+	this->format_framebuffer = 0;
 	this->curr_texture = 0;
 	this->prev_texture = 0;
 	this->damage_texture = 0;
+	this->format_texture = 0;
+	this->cursor_texture = 0;
+	for (int i = 0; i < MAX_IMAGES; ++i) {
+		this->images[i].ino = 0;
+		this->images[i].image = EGL_NO_IMAGE;
+		this->images[i].texture = 0;
+		this->images[i].used = 0;
+	}
+	this->n_image_uses = 0;
+	for (int i = 0; i < RF_MAX_SLOTS; ++i)
+		this->slot_images[i] = -1;
+	this->async_readback = false;
+	for (int i = 0; i < MAX_READBACKS; ++i) {
+		this->readbacks[i].buffer = 0;
+		this->readbacks[i].fence = NULL;
+	}
+	this->readback_head = 0;
+	this->n_readbacks = 0;
+	this->readback_lost = false;
 	this->tile_size = 4;
+	this->cpu_tile_size = 64;
 	this->rotation = 0;
 	this->damage_type = RF_DAMAGE_TYPE_CPU;
+	this->native_fence = false;
+	this->cpu = false;
+	this->canvas = NULL;
 	this->running = false;
 }
 
@@ -580,6 +1028,18 @@ void rf_converter_set_card_path(RfConverter *this, const char *card_path)
 	this->card_path = g_strdup(card_path);
 }
 
+// It takes effect when converting the next frame, pending frames in the old
+// pixel format are dropped.
+void rf_converter_set_pixel_format(
+	RfConverter *this,
+	enum rf_pixel_format format
+)
+{
+	g_return_if_fail(RF_IS_CONVERTER(this));
+
+	this->next_format = format;
+}
+
 int rf_converter_start(RfConverter *this)
 {
 	g_return_val_if_fail(RF_IS_CONVERTER(this), -1);
@@ -594,6 +1054,65 @@ int rf_converter_start(RfConverter *this)
 	this->rotation = rf_config_get_rotation(this->config);
 	g_message("GL: Got screen rotation %u.", this->rotation);
 	this->damage_type = rf_config_get_damage(this->config);
+	this->cpu_tile_size = rf_config_get_damage_tile_size(this->config);
+	this->width = 0;
+	this->height = 0;
+	this->prev_width = 0;
+	this->prev_height = 0;
+	this->cursor_width = 0;
+	this->cursor_height = 0;
+	this->prev_cursor_rect.w = 0;
+	this->prev_cursor_rect.h = 0;
+	this->prev_valid = false;
+	int ret = 0;
+	this->cpu = rf_config_get_cpu_convert(this->config);
+	if (this->cpu) {
+		g_message("Frame: Converting frames on CPU, skip EGL and GL.");
+	} else {
+		ret = setup_egl(this);
+		if (ret < 0)
+			goto out;
+		ret = setup_gl(this);
+		if (ret < 0)
+			goto out;
+	}
+
+	this->async_readback = rf_config_get_async_readback(this->config);
+	if (this->async_readback && this->cpu) {
+		g_message("Frame: Async readback does not work on CPU.");
+		this->async_readback = false;
+	}
+	if (this->async_readback && this->gles_major < 3) {
+		g_message("GL: Async readback requires GLES v3.");
+		this->async_readback = false;
+	}
+	g_message(
+		"GL: Async readback is %s.",
+		this->async_readback ? "enabled" : "disabled"
+	);
+	// GPU detection compares textures, but frames we return are behind
+	// textures with async readback.
+	if (this->async_readback && this->damage_type == RF_DAMAGE_TYPE_GPU) {
+		g_message(
+			"Frame: GPU damage region detection does not work with async readback, fallback to CPU."
+		);
+		this->damage_type = RF_DAMAGE_TYPE_CPU;
+	}
+	if (this->cpu && this->damage_type == RF_DAMAGE_TYPE_GPU) {
+		g_message(
+			"Frame: GPU damage region detection does not work without GPU, fallback to CPU."
+		);
+		this->damage_type = RF_DAMAGE_TYPE_CPU;
+	}
+	// GLES v3 shader reads exact texels and loops over tiles freely, so it
+	// is cheaper than comparing on CPU.
+	if (this->damage_type == RF_DAMAGE_TYPE_AUTO) {
+		if (!this->cpu && this->gles_major >= 3 &&
+		    !this->async_readback)
+			this->damage_type = RF_DAMAGE_TYPE_GPU;
+		else
+			this->damage_type = RF_DAMAGE_TYPE_CPU;
+	}
 	switch (this->damage_type) {
 	case RF_DAMAGE_TYPE_CPU:
 		g_message(
@@ -609,17 +1128,6 @@ int rf_converter_start(RfConverter *this)
 		g_message("Frame: No damage region detection implementation.");
 		break;
 	}
-	this->width = 0;
-	this->height = 0;
-	this->prev_width = 0;
-	this->prev_height = 0;
-	int ret = 0;
-	ret = setup_egl(this);
-	if (ret < 0)
-		goto out;
-	ret = setup_gl(this);
-	if (ret < 0)
-		goto out;
 
 	this->running = true;
 
@@ -648,31 +1156,35 @@ void rf_converter_stop(RfConverter *this)
 
 	this->running = false;
 
-	g_clear_pointer(&this->curr, g_byte_array_unref);
-	g_clear_pointer(&this->prev, g_byte_array_unref);
+	// Frames still referenced by VNC servers are freed after they drop
+	// them.
+	g_clear_pointer(&this->frames, g_ptr_array_unref);
+	this->curr = NULL;
+	this->prev = NULL;
+	g_clear_pointer(&this->cursor, g_byte_array_unref);
+	g_clear_pointer(&this->canvas, g_byte_array_unref);
 	g_clear_pointer(&this->card_path, g_free);
+	clean_images(this);
 	clean_gl(this);
 	clean_egl(this);
 }
 
 // We downscale texture into tiles on GPU, because we still need to scan the
 // result on CPU to get damage region, and per-pixel scanning is too heavy.
-// Because we actually compare the linear average color of a tile in shader,
-// larger tile size reduces the accuracy and causes artifacts. To increase
-// accuracy we generate mipmaps for textures and sampling the nearest mipmap,
-// then we need to ensure that tile size is power-of-2 to match mipmap.
+// Shader compares every pixel of a tile, so tile size does not affect the
+// accuracy, it only trades the readback size for the precision of region.
 //
-// For CPU damage region detection we could safely choose a relative larger value
-// as tile size. 16 is a balanced value between comparing and transfering.
+// For CPU damage region detection, tiles are compared row by row and damaged
+// ones are shrunk to changed pixels, so larger tiles mostly save calls.
 static void update_damage_size(RfConverter *this)
 {
 	if (this->damage_type == RF_DAMAGE_TYPE_GPU) {
 		if (this->width >= 1280 && this->height >= 720)
-			this->tile_size = 4;
+			this->tile_size = 8;
 		else
-			this->tile_size = 2;
+			this->tile_size = 4;
 	} else {
-		this->tile_size = 16;
+		this->tile_size = this->cpu_tile_size;
 	}
 
 	g_debug("GL: Set tile size of damage to %u.", this->tile_size);
@@ -683,6 +1195,22 @@ static void update_damage_size(RfConverter *this)
 		(this->height + this->tile_size - 1) / this->tile_size;
 }
 
+static void update_format_size(RfConverter *this)
+{
+	this->format = this->next_format;
+	this->stride = rf_pixel_format_get_stride(this->format, this->width);
+	this->format_width = this->stride / RF_BYTES_PER_PIXEL;
+
+	g_debug("GL: Set pixel format to %d with %u bytes per pixel.",
+		this->format,
+		rf_pixel_format_get_bpp(this->format));
+}
+
+static inline unsigned int get_texel_pixels(RfConverter *this)
+{
+	return RF_BYTES_PER_PIXEL / rf_pixel_format_get_bpp(this->format);
+}
+
 static inline void set_texture_parameters(GLenum target, GLint min_filter)
 {
 	// Setting sampling filter to scaling texture automatically.
@@ -702,7 +1230,7 @@ static void gen_textures(RfConverter *this)
 		glDeleteTextures(1, &this->curr_texture);
 	glGenTextures(1, &this->curr_texture);
 	glBindTexture(GL_TEXTURE_2D, this->curr_texture);
-	set_texture_parameters(GL_TEXTURE_2D, GL_LINEAR_MIPMAP_NEAREST);
+	set_texture_parameters(GL_TEXTURE_2D, GL_NEAREST);
 	glTexImage2D(
 		GL_TEXTURE_2D,
 		0,
@@ -720,7 +1248,7 @@ static void gen_textures(RfConverter *this)
 		glDeleteTextures(1, &this->prev_texture);
 	glGenTextures(1, &this->prev_texture);
 	glBindTexture(GL_TEXTURE_2D, this->prev_texture);
-	set_texture_parameters(GL_TEXTURE_2D, GL_LINEAR_MIPMAP_NEAREST);
+	set_texture_parameters(GL_TEXTURE_2D, GL_NEAREST);
 	glTexImage2D(
 		GL_TEXTURE_2D,
 		0,
@@ -756,6 +1284,67 @@ static void gen_textures(RfConverter *this)
 		NULL
 	);
 	glBindTexture(GL_TEXTURE_2D, 0);
+
+	if (this->format_texture != 0) {
+		glDeleteTextures(1, &this->format_texture);
+		this->format_texture = 0;
+	}
+	// Frames are read back from draw texture directly.
+	if (this->format == RF_PIXEL_FORMAT_RGBX8888)
+		return;
+
+	g_debug("GL: Generating new format texture for width %u and height %u.",
+		this->format_width,
+		this->height);
+
+	glGenTextures(1, &this->format_texture);
+	glBindTexture(GL_TEXTURE_2D, this->format_texture);
+	glTexImage2D(
+		GL_TEXTURE_2D,
+		0,
+		GL_RGBA,
+		this->format_width,
+		this->height,
+		0,
+		GL_RGBA,
+		GL_UNSIGNED_BYTE,
+		NULL
+	);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	// This texture is never swapped, so only attach it once.
+	glBindFramebuffer(GL_FRAMEBUFFER, this->format_framebuffer);
+	glFramebufferTexture2D(
+		GL_FRAMEBUFFER,
+		GL_COLOR_ATTACHMENT0,
+		GL_TEXTURE_2D,
+		this->format_texture,
+		0
+	);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+static void gen_cursor_texture(RfConverter *this)
+{
+	g_debug("GL: Generating new cursor texture for width %u and height %u.",
+		this->cursor_width,
+		this->cursor_height);
+
+	if (this->cursor_texture != 0)
+		glDeleteTextures(1, &this->cursor_texture);
+	glGenTextures(1, &this->cursor_texture);
+	glBindTexture(GL_TEXTURE_2D, this->cursor_texture);
+	glTexImage2D(
+		GL_TEXTURE_2D,
+		0,
+		GL_RGBA,
+		this->cursor_width,
+		this->cursor_height,
+		0,
+		GL_RGBA,
+		GL_UNSIGNED_BYTE,
+		NULL
+	);
+	glBindTexture(GL_TEXTURE_2D, 0);
 }
 
 static void gen_buffers(RfConverter *this)
@@ -764,16 +1353,100 @@ static void gen_buffers(RfConverter *this)
 		this->width,
 		this->height);
 
-	const unsigned int size =
-		RF_BYTES_PER_PIXEL * this->width * this->height;
+	const unsigned int size = this->stride * this->height;
+
+	// Frames are allocated on demand. Without previous frame, we will get a
+	// full update.
+	g_clear_pointer(&this->frames, g_ptr_array_unref);
+	this->frames = g_ptr_array_new_with_free_func(unref_frame);
+	this->curr = NULL;
+	this->prev = NULL;
+
+	g_clear_pointer(&this->canvas, g_byte_array_unref);
+	if (this->cpu && this->format != RF_PIXEL_FORMAT_RGBX8888)
+		this->canvas = g_byte_array_sized_new(
+			RF_BYTES_PER_PIXEL * this->width * this->height
+		);
+
+	// Length and every tile, so it never overflows even if all tiles are
+	// damaged.
+	if (this->compute_program != 0) {
+		if (this->tile_buffer == 0)
+			glGenBuffers(1, &this->tile_buffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->tile_buffer);
+		glBufferData(
+			GL_SHADER_STORAGE_BUFFER,
+			(1 + this->damage_width * this->damage_height) *
+				sizeof(uint32_t),
+			NULL,
+			GL_STREAM_READ
+		);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+
+	if (!this->async_readback)
+		return;
+	// Pending frames are in the old size, drop them.
+	for (int i = 0; i < MAX_READBACKS; ++i) {
+		struct readback *r = &this->readbacks[i];
+		clean_fence(r);
+		if (r->buffer == 0)
+			glGenBuffers(1, &r->buffer);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, r->buffer);
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	this->readback_head = 0;
+	this->n_readbacks = 0;
+	this->readback_lost = false;
+}
+
+// Previous frame is never written, because damage is detected against it.
+// Valid frames are preferred, so GPU only reads back the damaged part into it.
+static struct frame *get_free_frame(RfConverter *this)
+{
+	struct frame *found = NULL;
+	for (unsigned int i = 0; i < this->frames->len; ++i) {
+		struct frame *f = g_ptr_array_index(this->frames, i);
+		if (f == this->prev || !g_atomic_ref_count_compare(&f->ref, 1))
+			continue;
+		if (f->valid)
+			return f;
+		if (found == NULL)
+			found = f;
+	}
+	if (found != NULL)
+		return found;
+
+	found = new_frame(this->stride * this->height);
+	g_ptr_array_add(this->frames, found);
+	g_debug("Frame: Allocated frame buffer %u.", this->frames->len);
+	return found;
+}
 
-	g_clear_pointer(&this->curr, g_byte_array_unref);
-	this->curr = g_byte_array_sized_new(size);
+// Current frame becomes the previous one, and other frames miss its damage.
+static void commit_frame(RfConverter *this, const struct rf_region *damage)
+{
+	for (unsigned int i = 0; i < this->frames->len; ++i) {
+		struct frame *f = g_ptr_array_index(this->frames, i);
+		if (f == this->curr || !f->valid)
+			continue;
+		if (damage != NULL)
+			rf_region_union(&f->pending, damage);
+		else
+			f->valid = false;
+	}
+	this->curr->valid = true;
+	rf_region_clear(&this->curr->pending);
+	this->prev = this->curr;
+}
 
-	g_clear_pointer(&this->prev, g_byte_array_unref);
-	this->prev = g_byte_array_sized_new(size);
-	// Clear prev buffer so we will get a full update.
-	memset(this->prev->data, 0, size);
+static GBytes *ref_frame(RfConverter *this, struct frame *f)
+{
+	g_atomic_ref_count_inc(&f->ref);
+	return g_bytes_new_with_free_func(
+		f->data, this->stride * this->height, unref_frame, f
+	);
 }
 
 static inline void append_attrib(GArray *a, EGLAttrib k, EGLAttrib v)
@@ -865,47 +1538,47 @@ static EGLImage make_image(EGLDisplay display, const struct rf_buffer *b)
 	return image;
 }
 
-static void draw_begin(RfConverter *this)
+static bool is_same_image(const struct image *image, const struct rf_buffer *b)
 {
-	glBindFramebuffer(GL_FRAMEBUFFER, this->draw_framebuffer);
-	// We always rebind texture to framebuffer because we swap current and
-	// previous textures.
-	glFramebufferTexture2D(
-		GL_FRAMEBUFFER,
-		GL_COLOR_ATTACHMENT0,
-		GL_TEXTURE_2D,
-		this->curr_texture,
-		0
-	);
-	glViewport(0, 0, this->width, this->height);
+	if (image->fourcc != b->md.fourcc || image->width != b->md.fb_width ||
+	    image->height != b->md.fb_height ||
+	    image->modifier != b->md.modifier || image->length != b->md.length)
+		return false;
+	for (unsigned int i = 0; i < b->md.length; ++i)
+		if (image->offsets[i] != b->md.offsets[i] ||
+		    image->pitches[i] != b->md.pitches[i])
+			return false;
+	return true;
+}
 
-	glUseProgram(this->draw_program);
-	if (this->gles_major >= 3)
-		glBindVertexArray(this->draw_vertex_array);
-	else
-		bind_buffers(this, this->draw_program);
+static int find_image(RfConverter *this, ino_t ino, const struct rf_buffer *b)
+{
+	for (int i = 0; i < MAX_IMAGES; ++i) {
+		const struct image *image = &this->images[i];
+		if (image->image != EGL_NO_IMAGE && image->ino == ino &&
+		    is_same_image(image, b))
+			return i;
+	}
+	return -1;
 }
 
-static void draw_rect(
-	RfConverter *this,
-	EGLImage image,
-	// Texture coordinates.
-	uint32_t sx,
-	uint32_t sy,
-	uint32_t sw,
-	uint32_t sh,
-	uint32_t texture_width,
-	uint32_t texture_height,
-	// Vertex coordinates.
-	int32_t x,
-	int32_t y,
-	uint32_t w,
-	uint32_t h,
-	int32_t z,
-	uint32_t canvas_width,
-	uint32_t canvas_height
-)
+// Empty image is always the least recently used one.
+static int get_lru_image(RfConverter *this)
+{
+	int lru = 0;
+	for (int i = 1; i < MAX_IMAGES; ++i)
+		if (this->images[i].used < this->images[lru].used)
+			lru = i;
+	return lru;
+}
+
+static int make_texture(RfConverter *this, ino_t ino, const struct rf_buffer *b)
 {
+	EGLImage egl_image = make_image(this->display, b);
+	if (egl_image == EGL_NO_IMAGE) {
+		g_warning("EGL: Failed to create image: %d.", eglGetError());
+		return -1;
+	}
 	unsigned int texture;
 	glGenTextures(1, &texture);
 	glActiveTexture(GL_TEXTURE0);
@@ -915,24 +1588,164 @@ static void draw_rect(
 	glBindTexture(GL_TEXTURE_EXTERNAL_OES, texture);
 	// `GL_TEXTURE_EXTERNAL_OES` does not support mipmap.
 	set_texture_parameters(GL_TEXTURE_EXTERNAL_OES, GL_LINEAR);
-	glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, image);
+	glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, egl_image);
 	// g_debug("glEGLImageTargetTexture2DOES: %#x", glGetError());
+	glBindTexture(GL_TEXTURE_EXTERNAL_OES, 0);
 
-	mat4 model =
-		m4multiply(m4translate(v3s(x, y, z)), m4scale(v3s(w, h, 1.0f)));
-	mat4 view = m4camera(
-		v3s(0.0f, 0.0f, 0.0f),
-		v3s(0.0f, 0.0f, 1.0f),
-		v3s(0.0f, 1.0f, 0.0f)
-	);
-	mat4 projection =
-		m4ortho(0.0f, canvas_width, canvas_height, 0.0f, 0.1f, 100.0f);
-	mat4 mvp = m4multiply(projection, m4multiply(view, model));
-	// Rotating monitor is just the same as rotating the whole world.
-	if (this->rotation % 360 != 0)
-		mvp = m4multiply(
-			m4rotate(
-				v3s(0.0f, 0.0f, -1.0f), sradians(this->rotation)
+	const int i = get_lru_image(this);
+	clean_image(this, i);
+	struct image *image = &this->images[i];
+	image->ino = ino;
+	image->fourcc = b->md.fourcc;
+	image->width = b->md.fb_width;
+	image->height = b->md.fb_height;
+	image->modifier = b->md.modifier;
+	image->length = b->md.length;
+	for (unsigned int j = 0; j < b->md.length; ++j) {
+		image->offsets[j] = b->md.offsets[j];
+		image->pitches[j] = b->md.pitches[j];
+	}
+	image->image = egl_image;
+	image->texture = texture;
+	return i;
+}
+
+// Compositors draw into a few framebuffers in turn, creating image is slow on
+// some drivers, so we keep imported images and textures across frames and
+// only import when we never see the framebuffer before.
+static unsigned int import_buffer(RfConverter *this, const struct rf_buffer *b)
+{
+	const unsigned int slot = b->md.slot;
+	int i = this->slot_images[slot];
+	if (!b->md.cached || i < 0) {
+		struct stat st;
+		const ino_t ino = fstat(b->fds[0], &st) == 0 ? st.st_ino : 0;
+		// Without inode we cannot identify it, always import it.
+		i = ino != 0 ? find_image(this, ino, b) : -1;
+		if (i < 0) {
+			i = make_texture(this, ino, b);
+			if (i < 0)
+				return 0;
+			g_debug("EGL: Imported buffer into slot %u.", slot);
+		}
+		this->slot_images[slot] = i;
+	}
+	this->images[i].used = ++this->n_image_uses;
+	return this->images[i].texture;
+}
+
+// Compositor may still be rendering into the framebuffer when we get it. We
+// take the rendering fence from dma-buf and make GPU wait for it before
+// sampling, instead of blocking CPU or relying on implicit sync of drivers.
+static void wait_buffer(RfConverter *this, const struct rf_buffer *b)
+{
+#ifdef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+	if (!this->native_fence)
+		return;
+
+	struct dma_buf_export_sync_file req = { 0 };
+	req.flags = DMA_BUF_SYNC_READ;
+	req.fd = -1;
+	if (ioctl(b->fds[0], DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &req) < 0) {
+		// Kernel older than 6.0 does not support this.
+		if (errno == ENOTTY || errno == EINVAL) {
+			g_message(
+				"EGL: Failed to export sync file from dma-buf, disable waiting for framebuffer fences."
+			);
+			this->native_fence = false;
+		}
+		return;
+	}
+
+	// Fence is signaled if it has no pending rendering, we could skip it.
+	struct pollfd pfd = { .fd = req.fd, .events = POLLIN };
+	if (poll(&pfd, 1, 0) == 1) {
+		close(req.fd);
+		return;
+	}
+	g_debug("EGL: Framebuffer in slot %u is still being rendered.",
+		b->md.slot);
+
+	const EGLint attribs[] = { EGL_SYNC_NATIVE_FENCE_FD_ANDROID,
+				   req.fd,
+				   EGL_NONE };
+	EGLSyncKHR sync = eglCreateSyncKHR(
+		this->display, EGL_SYNC_NATIVE_FENCE_ANDROID, attribs
+	);
+	if (sync == EGL_NO_SYNC_KHR) {
+		// EGL only takes ownership of fd on success.
+		close(req.fd);
+		g_warning("EGL: Failed to create sync: %d.", eglGetError());
+		return;
+	}
+	// This only queues a wait into GPU command stream, it is safe to
+	// destroy sync after it.
+	if (!eglWaitSyncKHR(this->display, sync, 0))
+		g_warning("EGL: Failed to wait sync: %d.", eglGetError());
+	eglDestroySyncKHR(this->display, sync);
+#endif
+}
+
+static void draw_begin(
+	RfConverter *this,
+	unsigned int texture,
+	unsigned int width,
+	unsigned int height
+)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, this->draw_framebuffer);
+	// We always rebind texture to framebuffer because we swap current and
+	// previous textures, and cursor is drawn into its own texture.
+	glFramebufferTexture2D(
+		GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0
+	);
+	glViewport(0, 0, width, height);
+
+	glUseProgram(this->draw_program);
+	if (this->gles_major >= 3)
+		glBindVertexArray(this->draw_vertex_array);
+	else
+		bind_buffers(this, this->draw_program);
+}
+
+static void draw_rect(
+	RfConverter *this,
+	unsigned int texture,
+	// Texture coordinates.
+	uint32_t sx,
+	uint32_t sy,
+	uint32_t sw,
+	uint32_t sh,
+	uint32_t texture_width,
+	uint32_t texture_height,
+	// Vertex coordinates.
+	int32_t x,
+	int32_t y,
+	uint32_t w,
+	uint32_t h,
+	int32_t z,
+	uint32_t canvas_width,
+	uint32_t canvas_height
+)
+{
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_EXTERNAL_OES, texture);
+
+	mat4 model =
+		m4multiply(m4translate(v3s(x, y, z)), m4scale(v3s(w, h, 1.0f)));
+	mat4 view = m4camera(
+		v3s(0.0f, 0.0f, 0.0f),
+		v3s(0.0f, 0.0f, 1.0f),
+		v3s(0.0f, 1.0f, 0.0f)
+	);
+	mat4 projection =
+		m4ortho(0.0f, canvas_width, canvas_height, 0.0f, 0.1f, 100.0f);
+	mat4 mvp = m4multiply(projection, m4multiply(view, model));
+	// Rotating monitor is just the same as rotating the whole world.
+	if (this->rotation % 360 != 0)
+		mvp = m4multiply(
+			m4rotate(
+				v3s(0.0f, 0.0f, -1.0f), sradians(this->rotation)
 			),
 			mvp
 		);
@@ -969,7 +1782,6 @@ static void draw_rect(
 
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_EXTERNAL_OES, 0);
-	glDeleteTextures(1, &texture);
 }
 
 static void draw_buffer(
@@ -980,14 +1792,13 @@ static void draw_buffer(
 	uint32_t frame_height
 )
 {
-	EGLImage image = make_image(this->display, b);
-	if (image == EGL_NO_IMAGE) {
-		g_warning("EGL: Failed to create image: %d.", eglGetError());
+	const unsigned int texture = import_buffer(this, b);
+	if (texture == 0)
 		return;
-	}
+	wait_buffer(this, b);
 	draw_rect(
 		this,
-		image,
+		texture,
 		b->md.src_x,
 		b->md.src_y,
 		b->md.src_w,
@@ -1002,7 +1813,6 @@ static void draw_buffer(
 		frame_width,
 		frame_height
 	);
-	eglDestroyImage(this->display, image);
 }
 
 static void draw_end(RfConverter *this)
@@ -1016,12 +1826,89 @@ static void draw_end(RfConverter *this)
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
-static int
-convert_buffers(RfConverter *this, size_t length, const struct rf_buffer *bufs)
+// Bind the framebuffer we read frame from. If clients want another pixel
+// format, frame is packed into format texture first.
+static void bind_read_framebuffer(RfConverter *this, unsigned int texture)
+{
+	if (this->format == RF_PIXEL_FORMAT_RGBX8888) {
+		glBindFramebuffer(GL_FRAMEBUFFER, this->draw_framebuffer);
+		glFramebufferTexture2D(
+			GL_FRAMEBUFFER,
+			GL_COLOR_ATTACHMENT0,
+			GL_TEXTURE_2D,
+			texture,
+			0
+		);
+		return;
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, this->format_framebuffer);
+	glViewport(0, 0, this->format_width, this->height);
+	glUseProgram(this->format_program);
+	if (this->gles_major >= 3)
+		glBindVertexArray(this->format_vertex_array);
+	else
+		bind_buffers(this, this->format_program);
+	// Packed bytes are not colors, blending breaks them.
+	glDisable(GL_BLEND);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glUniform1i(
+		glGetUniformLocation(this->format_program, "pixels"),
+		get_texel_pixels(this)
+	);
+	glUniform2f(
+		glGetUniformLocation(this->format_program, "size"),
+		this->width,
+		this->height
+	);
+	// Always fullfill the whole canvas.
+	mat4 model = m4translate(v3s(0.0f, 0.0f, 1.0f));
+	mat4 view = m4camera(
+		v3s(0.0f, 0.0f, 0.0f),
+		v3s(0.0f, 0.0f, 1.0f),
+		v3s(0.0f, 1.0f, 0.0f)
+	);
+	mat4 projection = m4ortho(0.0f, 1.0f, 1.0f, 0.0f, 0.1f, 100.0f);
+	mat4 mvp = m4multiply(projection, m4multiply(view, model));
+	glUniformMatrix4fv(
+		glGetUniformLocation(this->format_program, "mvp"),
+		1,
+		false,
+		MARRAY(mvp)
+	);
+	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_BYTE, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glEnable(GL_BLEND);
+	if (this->gles_major >= 3)
+		glBindVertexArray(0);
+	else
+		unbind_buffers(this, this->format_program);
+	glUseProgram(0);
+}
+
+// Readback buffers are a ring, pending ones start from head.
+static inline struct readback *get_free_readback(RfConverter *this)
+{
+	const unsigned int i =
+		(this->readback_head + this->n_readbacks) % MAX_READBACKS;
+	return &this->readbacks[i];
+}
+
+// Without `readback`, frame is only drawn into texture, caller reads damaged
+// part of it later.
+static int convert_buffers(
+	RfConverter *this,
+	size_t length,
+	const struct rf_buffer *bufs,
+	bool readback
+)
 {
 	int res = 0;
 
-	draw_begin(this);
+	draw_begin(this, this->curr_texture, this->width, this->height);
 
 	const struct rf_buffer *primary = &bufs[0];
 	// Monitor size should be CRTC size.
@@ -1040,31 +1927,395 @@ convert_buffers(RfConverter *this, size_t length, const struct rf_buffer *bufs)
 			this, &bufs[i], length - i, frame_width, frame_height
 		);
 
+	if (!readback) {
+		draw_end(this);
+		return 0;
+	}
+
+	bind_read_framebuffer(this, this->curr_texture);
 	glPixelStorei(GL_PACK_ALIGNMENT, RF_BYTES_PER_PIXEL);
+	// Caller ensures there is a free readback buffer.
+	struct readback *r = NULL;
+	if (this->async_readback) {
+		r = get_free_readback(this);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, r->buffer);
+	}
 	// OpenGL ES only ensures `GL_RGBA` and `GL_RGB`, `GL_BGRA` is optional.
-	// But luckily LibVNCServer accepts RGBA by default.
+	// But luckily LibVNCServer accepts RGBA by default, and other formats
+	// are packed into RGBA texels.
+	//
+	// With a pixel pack buffer bound, this only queues a copy on GPU.
 	glReadPixels(
 		0,
 		0,
-		this->width,
+		this->format_width,
 		this->height,
 		GL_RGBA,
 		GL_UNSIGNED_BYTE,
-		this->curr->data
+		r != NULL ? NULL : this->curr->data
 	);
 	if (glGetError() != GL_NO_ERROR)
 		res = -1;
+	if (r != NULL) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		if (res >= 0) {
+			r->fence = glFenceSync(
+				GL_SYNC_GPU_COMMANDS_COMPLETE, 0
+			);
+			// Let GPU start before we return to main loop.
+			glFlush();
+			++this->n_readbacks;
+		}
+	}
 
 	draw_end(this);
 	return res;
 }
 
-static void damage_full(RfConverter *this, struct rf_rect *damage)
+// Read part of frame into the same position of current buffer. Only damaged
+// part is changed since the last frame, so we don't need to transfer the
+// whole frame.
+static int read_region(
+	RfConverter *this,
+	unsigned int texture,
+	const struct rf_region *region
+)
 {
-	damage->x = 0;
-	damage->y = 0;
-	damage->w = this->width;
-	damage->h = this->height;
+	int res = 0;
+
+	bind_read_framebuffer(this, texture);
+
+	glPixelStorei(GL_PACK_ALIGNMENT, RF_BYTES_PER_PIXEL);
+	if (this->gles_major >= 3)
+		glPixelStorei(GL_PACK_ROW_LENGTH, this->format_width);
+	const unsigned int pixels = get_texel_pixels(this);
+	for (unsigned int i = 0; i < region->length; ++i) {
+		const struct rf_rect *rect = &region->rects[i];
+		// GLES v2 cannot skip pixels in rows, so we read whole rows,
+		// they are continuous in buffer.
+		unsigned int x = 0;
+		unsigned int w = this->format_width;
+		if (this->gles_major >= 3) {
+			x = rect->x / pixels;
+			w = (rect->x + rect->w + pixels - 1) / pixels - x;
+		}
+		const size_t offset =
+			rect->y * this->stride + x * RF_BYTES_PER_PIXEL;
+		glReadPixels(
+			x,
+			rect->y,
+			w,
+			rect->h,
+			GL_RGBA,
+			GL_UNSIGNED_BYTE,
+			this->curr->data + offset
+		);
+	}
+	if (glGetError() != GL_NO_ERROR)
+		res = -1;
+	if (this->gles_major >= 3)
+		glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	return res;
+}
+
+// Framebuffer mapped into our memory, bytes of pixels are in R, G, B, A order
+// unless `swap` is set.
+struct plane {
+	uint8_t *map;
+	size_t size;
+	int fd;
+	const uint8_t *data;
+	size_t pitch;
+	bool swap;
+	bool alpha;
+};
+
+static bool get_cpu_format(uint32_t fourcc, bool *swap, bool *alpha)
+{
+	switch (fourcc) {
+	case DRM_FORMAT_XRGB8888:
+	case DRM_FORMAT_ARGB8888:
+		*swap = true;
+		*alpha = fourcc == DRM_FORMAT_ARGB8888;
+		return true;
+	case DRM_FORMAT_XBGR8888:
+	case DRM_FORMAT_ABGR8888:
+		*swap = false;
+		*alpha = fourcc == DRM_FORMAT_ABGR8888;
+		return true;
+	default:
+		return false;
+	}
+}
+
+static inline void sync_plane(const struct plane *p, uint64_t flags)
+{
+	struct dma_buf_sync sync = { .flags = flags | DMA_BUF_SYNC_READ };
+	// Not all exporters need or support it, reading still works.
+	if (ioctl(p->fd, DMA_BUF_IOCTL_SYNC, &sync) < 0 && errno != ENOTTY)
+		g_debug("Frame: Failed to sync dma-buf: %s.",
+			strerror(errno));
+}
+
+// Legacy framebuffers have no modifier, they are dumb buffers and should be
+// linear, otherwise we cannot read them without GPU.
+static int map_plane(const struct rf_buffer *b, struct plane *p)
+{
+	if (b->md.modifier != DRM_FORMAT_MOD_LINEAR &&
+	    b->md.modifier != DRM_FORMAT_MOD_INVALID) {
+		g_warning(
+			"Frame: Cannot read framebuffer with modifier %#lx on CPU.",
+			b->md.modifier
+		);
+		return -1;
+	}
+	if (!get_cpu_format(b->md.fourcc, &p->swap, &p->alpha)) {
+		g_warning(
+			"Frame: Cannot read framebuffer with fourcc %c%c%c%c on CPU.",
+			b->md.fourcc,
+			b->md.fourcc >> 8,
+			b->md.fourcc >> 16,
+			b->md.fourcc >> 24
+		);
+		return -1;
+	}
+	if (b->fds[0] < 0 || b->md.src_w == 0 || b->md.src_h == 0 ||
+	    b->md.crtc_w == 0 || b->md.crtc_h == 0 ||
+	    b->md.pitches[0] < b->md.fb_width * RF_BYTES_PER_PIXEL ||
+	    b->md.src_x + b->md.src_w > b->md.fb_width ||
+	    b->md.src_y + b->md.src_h > b->md.fb_height) {
+		g_warning("Frame: Invalid framebuffer layout.");
+		return -1;
+	}
+
+	p->fd = b->fds[0];
+	p->pitch = b->md.pitches[0];
+	p->size = b->md.offsets[0] + p->pitch * b->md.fb_height;
+	p->map = mmap(NULL, p->size, PROT_READ, MAP_SHARED, p->fd, 0);
+	if (p->map == MAP_FAILED) {
+		g_warning("Frame: Failed to map framebuffer: %s.",
+			  strerror(errno));
+		return -1;
+	}
+	p->data = p->map + b->md.offsets[0];
+	sync_plane(p, DMA_BUF_SYNC_START);
+	return 0;
+}
+
+static void unmap_plane(struct plane *p)
+{
+	sync_plane(p, DMA_BUF_SYNC_END);
+	munmap(p->map, p->size);
+}
+
+// Map every pixel on one axis of canvas to the byte offset of the pixel we
+// sample in framebuffer, or -1 if the plane does not cover it. This is nearest
+// sampling, so we only calculate it once per axis instead of per pixel.
+static void map_axis(
+	ptrdiff_t *offsets,
+	unsigned int length,
+	bool flip,
+	// Monitor size on this axis.
+	uint32_t monitor,
+	// Plane rect on monitor.
+	int32_t crtc,
+	uint32_t crtc_size,
+	// Plane rect on framebuffer.
+	uint32_t src,
+	uint32_t src_size,
+	size_t step
+)
+{
+	for (unsigned int i = 0; i < length; ++i) {
+		const int64_t j = flip ? length - 1 - i : i;
+		const int64_t m = (2 * j + 1) * monitor / (2 * length) - crtc;
+		if (m < 0 || m >= crtc_size) {
+			offsets[i] = -1;
+			continue;
+		}
+		offsets[i] = (src + m * src_size / crtc_size) * step;
+	}
+}
+
+static inline void
+read_pixel(const struct plane *p, const uint8_t *s, uint8_t *rgba)
+{
+	rgba[0] = p->swap ? s[2] : s[0];
+	rgba[1] = s[1];
+	rgba[2] = p->swap ? s[0] : s[2];
+	rgba[3] = p->alpha ? s[3] : 0xff;
+}
+
+// The same as drawing a plane with GL, but canvas is a RGBA buffer. Rotated
+// monitor is the same as rotated axes, and rows or columns of canvas may map
+// to columns or rows of framebuffer.
+static int draw_plane_cpu(
+	RfConverter *this,
+	const struct rf_buffer *b,
+	uint8_t *canvas,
+	unsigned int width,
+	unsigned int height,
+	// Plane rect on monitor.
+	int32_t x,
+	int32_t y,
+	uint32_t w,
+	uint32_t h,
+	uint32_t monitor_width,
+	uint32_t monitor_height,
+	bool blend
+)
+{
+	struct plane p;
+	if (map_plane(b, &p) < 0)
+		return -1;
+
+	g_autofree ptrdiff_t *xs = g_new(ptrdiff_t, width);
+	g_autofree ptrdiff_t *ys = g_new(ptrdiff_t, height);
+	const size_t bpp = RF_BYTES_PER_PIXEL;
+	const bool flip = this->rotation == 180;
+	if (rf_is_landscape(this->rotation)) {
+		map_axis(
+			xs,
+			width,
+			flip,
+			monitor_width,
+			x,
+			w,
+			b->md.src_x,
+			b->md.src_w,
+			bpp
+		);
+		map_axis(
+			ys,
+			height,
+			flip,
+			monitor_height,
+			y,
+			h,
+			b->md.src_y,
+			b->md.src_h,
+			p.pitch
+		);
+	} else {
+		map_axis(
+			xs,
+			width,
+			this->rotation == 90,
+			monitor_height,
+			y,
+			h,
+			b->md.src_y,
+			b->md.src_h,
+			p.pitch
+		);
+		map_axis(
+			ys,
+			height,
+			this->rotation == 270,
+			monitor_width,
+			x,
+			w,
+			b->md.src_x,
+			b->md.src_w,
+			bpp
+		);
+	}
+
+	for (unsigned int i = 0; i < height; ++i) {
+		if (ys[i] < 0)
+			continue;
+		const uint8_t *row = p.data + ys[i];
+		uint8_t *d = canvas + i * width * bpp;
+		for (unsigned int j = 0; j < width; ++j, d += bpp) {
+			if (xs[j] < 0)
+				continue;
+			uint8_t s[RF_BYTES_PER_PIXEL];
+			read_pixel(&p, row + xs[j], s);
+			if (!blend) {
+				memcpy(d, s, bpp);
+				continue;
+			}
+			const unsigned int a = s[3];
+			for (int k = 0; k < 3; ++k)
+				d[k] = (s[k] * a + d[k] * (0xff - a) + 0x7f) /
+				       0xff;
+		}
+	}
+
+	unmap_plane(&p);
+	return 0;
+}
+
+// Draw frame on CPU into current buffer, then it is the same as reading back
+// the whole frame.
+static int convert_buffers_cpu(
+	RfConverter *this,
+	size_t length,
+	const struct rf_buffer *bufs
+)
+{
+	const bool packed = this->format != RF_PIXEL_FORMAT_RGBX8888;
+	uint8_t *canvas = packed ? this->canvas->data : this->curr->data;
+
+	const struct rf_buffer *primary = &bufs[0];
+	const uint32_t frame_width = primary->md.crtc_width;
+	const uint32_t frame_height = primary->md.crtc_height;
+
+	if (primary->md.crtc_x > 0 || primary->md.crtc_y > 0 ||
+	    primary->md.crtc_x + primary->md.crtc_w < frame_width ||
+	    primary->md.crtc_y + primary->md.crtc_h < frame_height)
+		memset(canvas,
+		       0,
+		       RF_BYTES_PER_PIXEL * this->width * this->height);
+
+	// Only cursor plane is blended, we don't care about alpha of primary
+	// plane, clients ignore it. Like GL, we skip a cursor we cannot read,
+	// but without primary plane there is no frame.
+	for (size_t i = 0; i < length; ++i) {
+		const struct rf_buffer *b = &bufs[i];
+		const int res = draw_plane_cpu(
+			this,
+			b,
+			canvas,
+			this->width,
+			this->height,
+			b->md.crtc_x,
+			b->md.crtc_y,
+			b->md.crtc_w,
+			b->md.crtc_h,
+			frame_width,
+			frame_height,
+			i > 0
+		);
+		if (res < 0 && i == 0)
+			return res;
+	}
+
+	if (!packed)
+		return 0;
+
+	const unsigned int bpp = rf_pixel_format_get_bpp(this->format);
+	for (unsigned int y = 0; y < this->height; ++y) {
+		const uint8_t *s =
+			canvas + y * this->width * RF_BYTES_PER_PIXEL;
+		uint8_t *d = this->curr->data + y * this->stride;
+		for (unsigned int x = 0; x < this->width; ++x)
+			rf_pixel_format_pack(
+				this->format,
+				s + x * RF_BYTES_PER_PIXEL,
+				d + x * bpp
+			);
+	}
+	return 0;
+}
+
+static void damage_full(RfConverter *this, struct rf_region *damage)
+{
+	struct rf_rect rect = { 0, 0, this->width, this->height };
+	rf_region_clear(damage);
+	rf_region_add(damage, &rect);
 }
 
 static void damage_begin(RfConverter *this)
@@ -1099,10 +2350,19 @@ static void damage_rect(
 {
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, this->curr_texture);
-	glGenerateMipmap(GL_TEXTURE_2D);
 	glActiveTexture(GL_TEXTURE1);
 	glBindTexture(GL_TEXTURE_2D, this->prev_texture);
-	glGenerateMipmap(GL_TEXTURE_2D);
+
+	glUniform1i(
+		glGetUniformLocation(this->damage_program, "tile_size"),
+		this->tile_size
+	);
+	// Only used by GLES v2 shader, GLES v3 shader gets texture size.
+	glUniform2f(
+		glGetUniformLocation(this->damage_program, "size"),
+		this->width,
+		this->height
+	);
 
 	mat4 model =
 		m4multiply(m4translate(v3s(x, y, z)), m4scale(v3s(w, h, 1.0f)));
@@ -1140,8 +2400,98 @@ static void damage_end(RfConverter *this)
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
-static void detect_damage_gpu(RfConverter *this, struct rf_rect *damage)
+static void add_tiles(
+	RfConverter *this,
+	const uint32_t *tiles,
+	unsigned int length,
+	struct rf_region *damage
+)
 {
+	for (unsigned int i = 0; i < length; ++i) {
+		const unsigned int x = (tiles[i] & 0xffff) * this->tile_size;
+		const unsigned int y = (tiles[i] >> 16) * this->tile_size;
+		struct rf_rect rect = {
+			x,
+			y,
+			MIN(this->tile_size, this->width - x),
+			MIN(this->tile_size, this->height - y)
+		};
+		rf_region_add(damage, &rect);
+	}
+}
+
+// Only the length and damaged tiles are read back, so CPU cost depends on how
+// much changed instead of screen size.
+static void detect_damage_compute(RfConverter *this, struct rf_region *damage)
+{
+	const uint32_t zero = 0;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->tile_buffer);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(zero), &zero);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, this->tile_buffer);
+
+	glUseProgram(this->compute_program);
+	glUniform1i(
+		glGetUniformLocation(this->compute_program, "tile_size"),
+		this->tile_size
+	);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, this->curr_texture);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, this->prev_texture);
+	glDispatchCompute(
+		(this->damage_width + COMPUTE_GROUP_SIZE - 1) /
+			COMPUTE_GROUP_SIZE,
+		(this->damage_height + COMPUTE_GROUP_SIZE - 1) /
+			COMPUTE_GROUP_SIZE,
+		1
+	);
+	// Make shader writes visible to mapping.
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glUseProgram(0);
+
+	unsigned int length = 0;
+	const uint32_t *data = glMapBufferRange(
+		GL_SHADER_STORAGE_BUFFER, 0, sizeof(*data), GL_MAP_READ_BIT
+	);
+	if (data != NULL) {
+		length = MIN(data[0], this->damage_width * this->damage_height);
+		glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+	}
+	if (data != NULL && length > 0) {
+		data = glMapBufferRange(
+			GL_SHADER_STORAGE_BUFFER,
+			sizeof(*data),
+			length * sizeof(*data),
+			GL_MAP_READ_BIT
+		);
+		if (data != NULL) {
+			rf_region_clear(damage);
+			add_tiles(this, data, length, damage);
+			glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+		}
+	} else if (data != NULL) {
+		rf_region_clear(damage);
+	}
+	if (data == NULL) {
+		g_debug("Frame: Reading damage error, return full damage.");
+		damage_full(this, damage);
+	}
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+static void detect_damage_gpu(RfConverter *this, struct rf_region *damage)
+{
+	if (this->compute_program != 0) {
+		detect_damage_compute(this, damage);
+		return;
+	}
+
 	damage_begin(this);
 
 	// We always redraw the whole damage framebuffer so this is useless.
@@ -1179,123 +2529,424 @@ static void detect_damage_gpu(RfConverter *this, struct rf_rect *damage)
 		goto out;
 	}
 
-	unsigned int x1 = this->width;
-	unsigned int y1 = this->height;
-	unsigned int x2 = 0;
-	unsigned int y2 = 0;
-
+	rf_region_clear(damage);
+	// Each run of damaged tiles in a tile row is a rect, region merges
+	// runs touching each other.
 	const size_t stride = this->damage_width * RF_BYTES_PER_PIXEL;
 	for (unsigned int yt = 0; yt < this->damage_height; ++yt) {
-		for (unsigned int xt = 0; xt < this->damage_width; ++xt) {
-			const size_t offset =
-				yt * stride + xt * RF_BYTES_PER_PIXEL;
+		unsigned int xt = 0;
+		while (xt < this->damage_width) {
+			const size_t offset = yt * stride;
 			// Checking only the red channel is enough.
-			if (damage_buffer[offset] > 0) {
-				const unsigned int x = xt * this->tile_size;
-				const unsigned int y = yt * this->tile_size;
-				const unsigned int w =
-					MIN(this->tile_size, this->width - x);
-				const unsigned int h =
-					MIN(this->tile_size, this->height - y);
-
-				x1 = MIN(x1, x);
-				y1 = MIN(y1, y);
-				x2 = MAX(x2, x + w);
-				y2 = MAX(y2, y + h);
+			if (damage_buffer[offset + xt * RF_BYTES_PER_PIXEL] ==
+			    0) {
+				++xt;
+				continue;
 			}
+			const unsigned int start = xt;
+			while (xt < this->damage_width &&
+			       damage_buffer[offset + xt * RF_BYTES_PER_PIXEL] >
+				       0)
+				++xt;
+
+			const unsigned int x = start * this->tile_size;
+			const unsigned int y = yt * this->tile_size;
+			struct rf_rect rect = {
+				x,
+				y,
+				MIN((xt - start) * this->tile_size,
+				    this->width - x),
+				MIN(this->tile_size, this->height - y)
+			};
+			rf_region_add(damage, &rect);
 		}
 	}
 
-	if (x1 < x2 && y1 < y2) {
-		damage->x = x1;
-		damage->y = y1;
-		damage->w = x2 - x1;
-		damage->h = y2 - y1;
-	} else {
-		damage->x = 0;
-		damage->y = 0;
-		damage->w = 0;
-		damage->h = 0;
-	}
-
 out:
 	damage_end(this);
 }
 
-// This is a naive damage region detection but works fairly enough for us.
-static void detect_damage_cpu(RfConverter *this, struct rf_rect *damage)
+// Only called on damaged tiles, we shrink the range from both sides, so texels
+// between are skipped. Packed pixels are compared by texels.
+static void get_changed_columns(
+	const uint8_t *new,
+	const uint8_t *old,
+	unsigned int width,
+	unsigned int height,
+	size_t stride,
+	unsigned int *x1,
+	unsigned int *x2
+)
 {
-	unsigned int x1 = this->width;
-	unsigned int y1 = this->height;
-	unsigned int x2 = 0;
-	unsigned int y2 = 0;
+	for (unsigned int y = 0; y < height; ++y) {
+		const uint8_t *n = new + y * stride;
+		const uint8_t *o = old + y * stride;
+		unsigned int l = 0;
+		while (l < *x1 &&
+		       memcmp(n + l * RF_BYTES_PER_PIXEL,
+			      o + l * RF_BYTES_PER_PIXEL,
+			      RF_BYTES_PER_PIXEL) == 0)
+			++l;
+		*x1 = l;
+		unsigned int r = width;
+		while (r > *x2 &&
+		       memcmp(n + (r - 1) * RF_BYTES_PER_PIXEL,
+			      o + (r - 1) * RF_BYTES_PER_PIXEL,
+			      RF_BYTES_PER_PIXEL) == 0)
+			--r;
+		*x2 = r;
+	}
+}
+
+// Mark tiles of a tile row that differ, and return the range of changed rows.
+// Frames are scanned once row by row, unchanged rows only cost one `memcmp()`,
+// which is vectorized by libc with SSE2, AVX2 or NEON chosen at runtime, and
+// tiles already damaged are skipped in later rows.
+static void get_changed_tiles(
+	RfConverter *this,
+	const uint8_t *new,
+	const uint8_t *old,
+	unsigned int height,
+	uint8_t *tiles,
+	unsigned int *y1,
+	unsigned int *y2
+)
+{
+	const size_t stride = this->stride;
+	const size_t tile_stride =
+		this->tile_size / get_texel_pixels(this) * RF_BYTES_PER_PIXEL;
+	const size_t row_size = this->format_width * RF_BYTES_PER_PIXEL;
+	unsigned int n_tiles = 0;
+	*y1 = height;
+	*y2 = 0;
+	for (unsigned int y = 0; y < height; ++y) {
+		const uint8_t *n = new + y * stride;
+		const uint8_t *o = old + y * stride;
+		if (memcmp(n, o, row_size) == 0)
+			continue;
+		*y1 = MIN(*y1, y);
+		*y2 = y + 1;
+		for (unsigned int xt = 0;
+		     xt < this->damage_width && n_tiles < this->damage_width;
+		     ++xt) {
+			if (tiles[xt])
+				continue;
+			const size_t offset = xt * tile_stride;
+			const size_t size = MIN(tile_stride, row_size - offset);
+			if (memcmp(n + offset, o + offset, size) != 0) {
+				tiles[xt] = 1;
+				++n_tiles;
+			}
+		}
+	}
+}
+
+// Frames are compared by square tiles, each run of damaged tiles in a tile row
+// is shrunk to changed rows and columns, so separated changes become separated
+// small rects instead of full width bands.
+static void detect_damage_cpu(RfConverter *this, struct rf_region *damage)
+{
+	rf_region_clear(damage);
 
-	// Optimization: We don't compare by square tiles, but compare by rows,
-	// so we are accessing continuous memory.
-	//
-	// This will increase network bandwidth compared with square tiles based
-	// detection, but on the earth I am doing what VNC/RDP encoders should
-	// concern (but they does not), so please don't be too harsh on me. IMO
-	// you should avoid using remote desktop with mobile data hotspot.
 	const uint8_t *new = this->curr->data;
 	const uint8_t *old = this->prev->data;
-	const size_t stride = this->width * RF_BYTES_PER_PIXEL;
-	const unsigned int x = 0;
-	const unsigned int w = this->width;
-	for (unsigned int y = 0; y < this->height; y += this->tile_size) {
+	const size_t stride = this->stride;
+	const unsigned int pixels = get_texel_pixels(this);
+	// Tile size is a multiple of 4, so tiles always have whole texels.
+	const unsigned int tile_width = this->tile_size / pixels;
+	g_autofree uint8_t *tiles = g_new(uint8_t, this->damage_width);
+	for (unsigned int yt = 0; yt < this->damage_height; ++yt) {
+		const unsigned int y = yt * this->tile_size;
 		const unsigned int h = MIN(this->tile_size, this->height - y);
-		const size_t offset = y * stride + x * RF_BYTES_PER_PIXEL;
-		const size_t size = w * h * RF_BYTES_PER_PIXEL;
-		if (memcmp(new + offset, old + offset, size) != 0) {
-			x1 = MIN(x1, x);
-			y1 = MIN(y1, y);
-			x2 = MAX(x2, x + w);
-			y2 = MAX(y2, y + h);
+		memset(tiles, 0, this->damage_width);
+		unsigned int y1 = 0;
+		unsigned int y2 = 0;
+		get_changed_tiles(
+			this,
+			new + y * stride,
+			old + y * stride,
+			h,
+			tiles,
+			&y1,
+			&y2
+		);
+		if (y1 >= y2)
+			continue;
+
+		const size_t offset = (y + y1) * stride;
+		unsigned int xt = 0;
+		while (xt < this->damage_width) {
+			if (!tiles[xt]) {
+				++xt;
+				continue;
+			}
+			const unsigned int start = xt;
+			while (xt < this->damage_width && tiles[xt])
+				++xt;
+
+			const unsigned int l = start * tile_width;
+			const unsigned int w =
+				MIN(xt * tile_width, this->format_width) - l;
+			unsigned int x1 = w;
+			unsigned int x2 = 0;
+			get_changed_columns(
+				new + offset + l * RF_BYTES_PER_PIXEL,
+				old + offset + l * RF_BYTES_PER_PIXEL,
+				w,
+				y2 - y1,
+				stride,
+				&x1,
+				&x2
+			);
+			if (x1 >= x2)
+				continue;
+			x1 = (l + x1) * pixels;
+			x2 = MIN((l + x2) * pixels, this->width);
+			struct rf_rect rect = { x1, y + y1, x2 - x1, y2 - y1 };
+			rf_region_add(damage, &rect);
 		}
 	}
-
-	if (x1 < x2 && y1 < y2) {
-		damage->x = x1;
-		damage->y = y1;
-		damage->w = x2 - x1;
-		damage->h = y2 - y1;
-	} else {
-		damage->x = 0;
-		damage->y = 0;
-		damage->w = 0;
-		damage->h = 0;
-	}
 }
 
-static void detect_damage(RfConverter *this, struct rf_rect *damage)
+static void detect_damage(RfConverter *this, struct rf_region *damage)
 {
 	if (this->damage_type == RF_DAMAGE_TYPE_GPU) {
 		detect_damage_gpu(this, damage);
 		unsigned int swap_texture = this->curr_texture;
 		this->curr_texture = this->prev_texture;
 		this->prev_texture = swap_texture;
-	} else if (this->damage_type == RF_DAMAGE_TYPE_CPU) {
+	} else if (this->damage_type == RF_DAMAGE_TYPE_CPU &&
+		   this->prev != NULL) {
 		detect_damage_cpu(this, damage);
-		memcpy(this->prev->data,
-		       this->curr->data,
-		       RF_BYTES_PER_PIXEL * this->width * this->height);
 	} else {
 		damage_full(this, damage);
 	}
-	g_debug("Frame: Got buffer damage: x %u, y %u, width %u, height %u.",
-		damage->x,
-		damage->y,
-		damage->w,
-		damage->h);
+	rf_region_debug(damage, "buffer damage");
+}
+
+static inline void get_cursor_rect(
+	size_t length,
+	const struct rf_buffer *bufs,
+	struct rf_rect *rect
+)
+{
+	rect->x = 0;
+	rect->y = 0;
+	rect->w = 0;
+	rect->h = 0;
+	// Streamer only sends primary plane and cursor plane.
+	if (length > 1) {
+		rect->x = bufs[1].md.crtc_x;
+		rect->y = bufs[1].md.crtc_y;
+		rect->w = bufs[1].md.crtc_w;
+		rect->h = bufs[1].md.crtc_h;
+	}
+}
+
+// Clips are on monitor, so we rotate and scale them like frames, and round
+// outwards with 1 more pixel because linear sampling spreads changes to
+// neighbours.
+static void map_rect(
+	RfConverter *this,
+	const struct rf_buffer *primary,
+	const struct rf_rect *rect,
+	struct rf_region *damage
+)
+{
+	const double w = primary->md.crtc_width;
+	const double h = primary->md.crtc_height;
+	const double x1 = rect->x / w;
+	const double y1 = rect->y / h;
+	const double x2 = (rect->x + (int)rect->w) / w;
+	const double y2 = (rect->y + (int)rect->h) / h;
+	double rx1 = x1;
+	double ry1 = y1;
+	double rx2 = x2;
+	double ry2 = y2;
+	switch (this->rotation) {
+	case 90:
+		rx1 = 1 - y2;
+		ry1 = x1;
+		rx2 = 1 - y1;
+		ry2 = x2;
+		break;
+	case 180:
+		rx1 = 1 - x2;
+		ry1 = 1 - y2;
+		rx2 = 1 - x1;
+		ry2 = 1 - y1;
+		break;
+	case 270:
+		rx1 = y1;
+		ry1 = 1 - x2;
+		rx2 = y2;
+		ry2 = 1 - x1;
+		break;
+	default:
+		break;
+	}
+	const int fx1 = MAX(0, (int)floor(rx1 * this->width) - 1);
+	const int fy1 = MAX(0, (int)floor(ry1 * this->height) - 1);
+	const int fx2 = MIN((int)this->width, (int)ceil(rx2 * this->width) + 1);
+	const int fy2 =
+		MIN((int)this->height, (int)ceil(ry2 * this->height) + 1);
+	if (fx1 >= fx2 || fy1 >= fy2)
+		return;
+	struct rf_rect mapped = { fx1, fy1, fx2 - fx1, fy2 - fy1 };
+	rf_region_add(damage, &mapped);
 }
 
-GByteArray *rf_converter_convert(
+// Use damage clips from compositor instead of comparing frames.
+static bool get_damage_clips(
+	RfConverter *this,
+	size_t length,
+	const struct rf_buffer *bufs,
+	struct rf_region *damage
+)
+{
+	const struct rf_buffer *primary = &bufs[0];
+	if (!this->prev_valid || !primary->md.has_damage)
+		return false;
+
+	rf_region_clear(damage);
+	for (unsigned int i = 0; i < primary->md.damage.length; ++i)
+		map_rect(this, primary, &primary->md.damage.rects[i], damage);
+
+	struct rf_rect cursor_rect;
+	get_cursor_rect(length, bufs, &cursor_rect);
+	if (cursor_rect.x != this->prev_cursor_rect.x ||
+	    cursor_rect.y != this->prev_cursor_rect.y ||
+	    cursor_rect.w != this->prev_cursor_rect.w ||
+	    cursor_rect.h != this->prev_cursor_rect.h ||
+	    (length > 1 && !bufs[1].md.unchanged)) {
+		if (cursor_rect.w != 0 && cursor_rect.h != 0)
+			map_rect(this, primary, &cursor_rect, damage);
+		if (this->prev_cursor_rect.w != 0 &&
+		    this->prev_cursor_rect.h != 0)
+			map_rect(
+				this, primary, &this->prev_cursor_rect, damage
+			);
+	}
+	return true;
+}
+
+// Keep previous texture the same as what clients got, in case we need to
+// detect damage region for the next frame. Previous frame on CPU is just the
+// current one after it is committed.
+static void sync_damage(RfConverter *this, const struct rf_region *damage)
+{
+	if (this->damage_type == RF_DAMAGE_TYPE_GPU) {
+		unsigned int swap_texture = this->curr_texture;
+		this->curr_texture = this->prev_texture;
+		this->prev_texture = swap_texture;
+	}
+	rf_region_debug(damage, "buffer damage from clips");
+}
+
+// Copy out the newest finished frame without waiting. Older finished frames
+// are dropped and their damage is merged into the newest one.
+static GBytes *collect_readbacks(
+	RfConverter *this,
+	struct rf_region *damage
+)
+{
+	bool has_clips = !this->readback_lost;
+	struct rf_region clips;
+	rf_region_clear(&clips);
+	struct readback *ready = NULL;
+	while (this->n_readbacks > 0) {
+		struct readback *r = &this->readbacks[this->readback_head];
+		const GLenum status = glClientWaitSync(r->fence, 0, 0);
+		if (status != GL_ALREADY_SIGNALED &&
+		    status != GL_CONDITION_SATISFIED)
+			break;
+		clean_fence(r);
+		has_clips = has_clips && r->has_clips;
+		rf_region_union(&clips, &r->clips);
+		ready = r;
+		this->readback_head = (this->readback_head + 1) % MAX_READBACKS;
+		--this->n_readbacks;
+	}
+	if (ready == NULL)
+		return NULL;
+
+	this->curr = get_free_frame(this);
+	const size_t size = this->stride * this->height;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, ready->buffer);
+	const void *data = glMapBufferRange(
+		GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT
+	);
+	if (data != NULL) {
+		memcpy(this->curr->data, data, size);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	if (data == NULL) {
+		g_warning(
+			"GL: Failed to map readback buffer: %#x.", glGetError()
+		);
+		this->readback_lost = true;
+		this->curr->valid = false;
+		return NULL;
+	}
+	this->readback_lost = false;
+
+	if (damage != NULL) {
+		if (this->damage_type != RF_DAMAGE_TYPE_DUMB && has_clips) {
+			*damage = clips;
+			sync_damage(this, damage);
+		} else {
+			detect_damage(this, damage);
+		}
+	}
+	commit_frame(this, damage);
+	if (damage != NULL && rf_region_is_empty(damage)) {
+		g_debug("Frame: Empty damage, return empty buffer.");
+		return NULL;
+	}
+	return ref_frame(this, this->curr);
+}
+
+// Returns a previous frame if it is finished, while this frame is being drawn.
+static GBytes *convert_async(
+	RfConverter *this,
+	size_t length,
+	const struct rf_buffer *bufs,
+	struct rf_region *damage
+)
+{
+	// GPU cannot keep up with us, we have to wait for the oldest frame to
+	// get a free buffer.
+	if (this->n_readbacks == MAX_READBACKS) {
+		g_debug("GL: All readback buffers are busy, waiting for GPU.");
+		glClientWaitSync(
+			this->readbacks[this->readback_head].fence,
+			GL_SYNC_FLUSH_COMMANDS_BIT,
+			GL_TIMEOUT_IGNORED
+		);
+	}
+	GBytes *buf = collect_readbacks(this, damage);
+
+	struct readback *r = get_free_readback(this);
+	rf_region_clear(&r->clips);
+	r->has_clips = damage != NULL &&
+		       this->damage_type != RF_DAMAGE_TYPE_DUMB &&
+		       get_damage_clips(this, length, bufs, &r->clips);
+	const int res = convert_buffers(this, length, bufs, true);
+	this->prev_valid = res >= 0 && damage != NULL;
+	get_cursor_rect(length, bufs, &this->prev_cursor_rect);
+	return buf;
+}
+
+// Returns a new reference of frame, the buffer won't be written again before
+// all references are dropped.
+GBytes *rf_converter_convert(
 	RfConverter *this,
 	size_t length,
 	const struct rf_buffer *bufs,
 	unsigned int width,
 	unsigned int height,
-	struct rf_rect *damage
+	struct rf_region *damage
 )
 {
 	g_return_val_if_fail(RF_IS_CONVERTER(this), NULL);
@@ -1306,7 +2957,8 @@ GByteArray *rf_converter_convert(
 	if (!this->running)
 		return NULL;
 
-	if (!eglMakeCurrent(
+	if (!this->cpu &&
+	    !eglMakeCurrent(
 		    this->display, EGL_NO_SURFACE, EGL_NO_SURFACE, this->context
 	    )) {
 		g_warning(
@@ -1319,17 +2971,49 @@ GByteArray *rf_converter_convert(
 	const int64_t begin = g_get_monotonic_time();
 #endif
 
-	if (this->width != width || this->height != height) {
+	// Frames in old pixel format are dropped like in old size.
+	if (this->width != width || this->height != height ||
+	    this->format != this->next_format) {
 		this->width = width;
 		this->height = height;
 		update_damage_size(this);
-		gen_textures(this);
+		update_format_size(this);
+		if (!this->cpu)
+			gen_textures(this);
 		gen_buffers(this);
+		this->prev_valid = false;
 	}
 
-	int res = convert_buffers(this, length, bufs);
-	if (res >= 0 && damage != NULL)
-		detect_damage(this, damage);
+	if (this->async_readback)
+		return convert_async(this, length, bufs, damage);
+
+	// GPU knows damage region before reading back, so we only read back
+	// damaged part if current buffer holds an older frame.
+	this->curr = get_free_frame(this);
+	const bool partial = damage != NULL &&
+			     this->damage_type == RF_DAMAGE_TYPE_GPU &&
+			     this->curr->valid;
+	int res = this->cpu ? convert_buffers_cpu(this, length, bufs) :
+			      convert_buffers(this, length, bufs, !partial);
+	if (res >= 0 && damage != NULL) {
+		if (this->damage_type != RF_DAMAGE_TYPE_DUMB &&
+		    get_damage_clips(this, length, bufs, damage))
+			sync_damage(this, damage);
+		else
+			detect_damage(this, damage);
+		// Textures are swapped, the new frame is previous texture now.
+		// Current buffer also misses damage of frames after it.
+		struct rf_region region = this->curr->pending;
+		rf_region_union(&region, damage);
+		if (partial && !rf_region_is_empty(&region))
+			res = read_region(this, this->prev_texture, &region);
+	}
+	if (res >= 0)
+		commit_frame(this, damage);
+	else
+		this->curr->valid = false;
+	this->prev_valid = res >= 0 && damage != NULL;
+	get_cursor_rect(length, bufs, &this->prev_cursor_rect);
 
 #ifdef __DEBUG__
 	const int64_t end = g_get_monotonic_time();
@@ -1339,10 +3023,160 @@ GByteArray *rf_converter_convert(
 	if (res < 0)
 		return NULL;
 
-	if (damage != NULL && damage->w == 0 && damage->h == 0) {
+	if (damage != NULL && rf_region_is_empty(damage)) {
 		g_debug("Frame: Empty damage, return empty buffer.");
 		return NULL;
 	}
 
-	return this->curr;
+	return ref_frame(this, this->curr);
+}
+
+// Cursor is drawn alone with the same rotation as frames, so clients could draw
+// it locally. @width and @height are the rotated and scaled cursor size.
+GByteArray *rf_converter_convert_cursor(
+	RfConverter *this,
+	const struct rf_buffer *b,
+	unsigned int width,
+	unsigned int height
+)
+{
+	g_return_val_if_fail(RF_IS_CONVERTER(this), NULL);
+	g_return_val_if_fail(b != NULL, NULL);
+	g_return_val_if_fail(width > 0 && height > 0, NULL);
+
+	if (!this->running)
+		return NULL;
+
+	if (!this->cpu &&
+	    !eglMakeCurrent(
+		    this->display, EGL_NO_SURFACE, EGL_NO_SURFACE, this->context
+	    )) {
+		g_warning(
+			"EGL: Failed to make context current: %d.", eglGetError()
+		);
+		return NULL;
+	}
+
+	if (this->cursor_width != width || this->cursor_height != height) {
+		this->cursor_width = width;
+		this->cursor_height = height;
+		if (!this->cpu)
+			gen_cursor_texture(this);
+		g_clear_pointer(&this->cursor, g_byte_array_unref);
+		this->cursor = g_byte_array_sized_new(
+			RF_BYTES_PER_PIXEL * width * height
+		);
+	}
+
+	if (this->cpu) {
+		memset(this->cursor->data,
+		       0,
+		       RF_BYTES_PER_PIXEL * width * height);
+		const int res = draw_plane_cpu(
+			this,
+			b,
+			this->cursor->data,
+			width,
+			height,
+			0,
+			0,
+			b->md.crtc_w,
+			b->md.crtc_h,
+			b->md.crtc_w,
+			b->md.crtc_h,
+			false
+		);
+		return res < 0 ? NULL : this->cursor;
+	}
+
+	const unsigned int texture = import_buffer(this, b);
+	if (texture == 0)
+		return NULL;
+	wait_buffer(this, b);
+
+	int res = 0;
+
+	draw_begin(this, this->cursor_texture, width, height);
+
+	// Blending with the cleared canvas changes alpha, we want cursor pixels
+	// as they are.
+	glDisable(GL_BLEND);
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	draw_rect(
+		this,
+		texture,
+		b->md.src_x,
+		b->md.src_y,
+		b->md.src_w,
+		b->md.src_h,
+		b->md.fb_width,
+		b->md.fb_height,
+		0,
+		0,
+		b->md.crtc_w,
+		b->md.crtc_h,
+		1,
+		b->md.crtc_w,
+		b->md.crtc_h
+	);
+
+	glPixelStorei(GL_PACK_ALIGNMENT, RF_BYTES_PER_PIXEL);
+	glReadPixels(
+		0,
+		0,
+		width,
+		height,
+		GL_RGBA,
+		GL_UNSIGNED_BYTE,
+		this->cursor->data
+	);
+	if (glGetError() != GL_NO_ERROR)
+		res = -1;
+
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	glEnable(GL_BLEND);
+
+	draw_end(this);
+
+	if (res < 0)
+		return NULL;
+
+	return this->cursor;
+}
+
+bool rf_converter_has_pending(RfConverter *this)
+{
+	g_return_val_if_fail(RF_IS_CONVERTER(this), false);
+
+	return this->running && this->n_readbacks > 0;
+}
+
+GBytes *rf_converter_collect(
+	RfConverter *this,
+	unsigned int width,
+	unsigned int height,
+	struct rf_region *damage
+)
+{
+	g_return_val_if_fail(RF_IS_CONVERTER(this), NULL);
+
+	if (!this->running || this->n_readbacks == 0)
+		return NULL;
+
+	// Frames in old size are dropped when converting in new size.
+	if (this->width != width || this->height != height)
+		return NULL;
+
+	if (!eglMakeCurrent(
+		    this->display, EGL_NO_SURFACE, EGL_NO_SURFACE, this->context
+	    )) {
+		g_warning(
+			"EGL: Failed to make context current: %d.", eglGetError()
+		);
+		return NULL;
+	}
+
+	return collect_readbacks(this, damage);
 }
@@ -13,16 +13,33 @@ G_DECLARE_FINAL_TYPE(RfConverter, rf_converter, RF, CONVERTER, GObject)
 
 RfConverter *rf_converter_new(RfConfig *config);
 void rf_converter_set_card_path(RfConverter *this, const char *card_path);
+void rf_converter_set_pixel_format(
+	RfConverter *this,
+	enum rf_pixel_format format
+);
 int rf_converter_start(RfConverter *this);
 bool rf_converter_is_running(RfConverter *this);
 void rf_converter_stop(RfConverter *this);
-GByteArray *rf_converter_convert(
+GBytes *rf_converter_convert(
 	RfConverter *this,
 	size_t length,
 	const struct rf_buffer *bufs,
 	unsigned int width,
 	unsigned int height,
-	struct rf_rect *damage
+	struct rf_region *damage
+);
+GByteArray *rf_converter_convert_cursor(
+	RfConverter *this,
+	const struct rf_buffer *b,
+	unsigned int width,
+	unsigned int height
+);
+bool rf_converter_has_pending(RfConverter *this);
+GBytes *rf_converter_collect(
+	RfConverter *this,
+	unsigned int width,
+	unsigned int height,
+	struct rf_region *damage
 );
 
 G_END_DECLS
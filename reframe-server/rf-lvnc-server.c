@@ -4,17 +4,71 @@
 #include "rf-common.h"
 #include "rf-lvnc-server.h"
 
+// Don't move cursor of clients if they moved pointer recently.
+#define POINTER_IDLE_INTERVAL (G_USEC_PER_SEC / 2)
+
+// Indexed by `enum rf_pixel_format`, pixels are little endian.
+static const rfbPixelFormat pixel_formats[] = {
+	[RF_PIXEL_FORMAT_RGBX8888] = { .bitsPerPixel = 32,
+				       .depth = 24,
+				       .trueColour = TRUE,
+				       .redMax = 255,
+				       .greenMax = 255,
+				       .blueMax = 255,
+				       .redShift = 0,
+				       .greenShift = 8,
+				       .blueShift = 16 },
+	[RF_PIXEL_FORMAT_BGRX8888] = { .bitsPerPixel = 32,
+				       .depth = 24,
+				       .trueColour = TRUE,
+				       .redMax = 255,
+				       .greenMax = 255,
+				       .blueMax = 255,
+				       .redShift = 16,
+				       .greenShift = 8,
+				       .blueShift = 0 },
+	[RF_PIXEL_FORMAT_RGB565] = { .bitsPerPixel = 16,
+				     .depth = 16,
+				     .trueColour = TRUE,
+				     .redMax = 31,
+				     .greenMax = 63,
+				     .blueMax = 31,
+				     .redShift = 11,
+				     .greenShift = 5,
+				     .blueShift = 0 },
+	[RF_PIXEL_FORMAT_BGR233] = { .bitsPerPixel = 8,
+				     .depth = 8,
+				     .trueColour = TRUE,
+				     .redMax = 7,
+				     .greenMax = 7,
+				     .blueMax = 3,
+				     .redShift = 0,
+				     .greenShift = 3,
+				     .blueShift = 6 }
+};
+
 struct _RfLVNCServer {
 	RfVNCServer parent_instance;
 	RfConfig *config;
 	GSocketService *service;
-	GByteArray *buf;
+	GBytes *buf;
 	GIOCondition io_flags;
 	rfbScreenInfo *screen;
 	char *passwords[2];
 	char *desktop_name;
 	unsigned int width;
 	unsigned int height;
+	int64_t pointer_time;
+	// Format of buffer and what we told main to convert next frames to.
+	enum rf_pixel_format format;
+	enum rf_pixel_format next_format;
+	// Rich cursor is in server pixel format, we keep the RGBA one to pack
+	// it again if format changes.
+	GByteArray *cursor;
+	unsigned int cursor_width;
+	unsigned int cursor_height;
+	unsigned int hotspot_x;
+	unsigned int hotspot_y;
 };
 G_DEFINE_TYPE(RfLVNCServer, rf_lvnc_server, RF_TYPE_VNC_SERVER)
 
@@ -31,6 +85,105 @@ static int on_socket_in(GSocket *socket, GIOCondition condition, void *data)
 	return G_SOURCE_CONTINUE;
 }
 
+static bool is_same_format(const rfbPixelFormat *a, const rfbPixelFormat *b)
+{
+	// Endian does not matter for 1 byte.
+	return a->bitsPerPixel == b->bitsPerPixel &&
+	       (a->bitsPerPixel == 8 || a->bigEndian == b->bigEndian) &&
+	       a->trueColour && b->trueColour && a->redMax == b->redMax &&
+	       a->greenMax == b->greenMax && a->blueMax == b->blueMax &&
+	       a->redShift == b->redShift && a->greenShift == b->greenShift &&
+	       a->blueShift == b->blueShift;
+}
+
+// Unknown formats are translated from RGBX by libvncserver, like before.
+static enum rf_pixel_format find_format(const rfbPixelFormat *f)
+{
+	for (size_t i = 0; i < G_N_ELEMENTS(pixel_formats); ++i)
+		if (is_same_format(f, &pixel_formats[i]))
+			return i;
+	return RF_PIXEL_FORMAT_RGBX8888;
+}
+
+static void set_cursor(RfLVNCServer *this)
+{
+	// Clients get an empty cursor.
+	if (this->cursor == NULL) {
+		rfbSetCursor(this->screen, NULL);
+		return;
+	}
+
+	// libvncserver frees cursor with `free()` when replacing it, so we
+	// cannot use GLib allocators here.
+	const unsigned int width = this->cursor_width;
+	const unsigned int height = this->cursor_height;
+	const uint8_t *data = this->cursor->data;
+	const unsigned int bpp = rf_pixel_format_get_bpp(this->format);
+	const size_t size = width * height;
+	const size_t stride = (width + 7) / 8;
+	rfbCursor *cursor = calloc(1, sizeof(*cursor));
+	cursor->width = width;
+	cursor->height = height;
+	cursor->xhot = this->hotspot_x;
+	cursor->yhot = this->hotspot_y;
+	cursor->richSource = malloc(size * bpp);
+	cursor->alphaSource = malloc(size);
+	cursor->mask = calloc(stride * height, sizeof(*cursor->mask));
+	for (unsigned int y = 0; y < height; ++y) {
+		for (unsigned int x = 0; x < width; ++x) {
+			const size_t i = y * width + x;
+			const uint8_t *p = data + i * RF_BYTES_PER_PIXEL;
+			uint8_t *d = cursor->richSource + i * bpp;
+			rf_pixel_format_pack(this->format, p, d);
+			const uint8_t alpha = p[3];
+			cursor->alphaSource[i] = alpha;
+			if (alpha > 0)
+				cursor->mask[y * stride + x / 8] |=
+					0x80 >> (x % 8);
+		}
+	}
+	// DRM cursor planes use premultiplied alpha.
+	cursor->alphaPreMultiplied = TRUE;
+	cursor->cleanup = TRUE;
+	cursor->cleanupMask = TRUE;
+	cursor->cleanupRichSource = TRUE;
+	rfbSetCursor(this->screen, cursor);
+}
+
+static void set_framebuffer(RfLVNCServer *this)
+{
+	rfbNewFramebuffer(
+		this->screen,
+		(char *)g_bytes_get_data(this->buf, NULL),
+		this->width,
+		this->height,
+		8,
+		3,
+		rf_pixel_format_get_bpp(this->format)
+	);
+	if (this->format == RF_PIXEL_FORMAT_RGBX8888)
+		return;
+
+	// libvncserver only guesses formats by bits, so we set it ourselves and
+	// redo what it does for the new format.
+	rfbScreenInfo *screen = this->screen;
+	screen->serverFormat = pixel_formats[this->format];
+	screen->bitsPerPixel = screen->serverFormat.bitsPerPixel;
+	screen->depth = screen->serverFormat.depth;
+	screen->paddedWidthInBytes =
+		rf_pixel_format_get_stride(this->format, this->width);
+	rfbClientIteratorPtr it = rfbGetClientIterator(screen);
+	rfbClientRec *cl;
+	while ((cl = rfbClientIteratorNext(it))) {
+		// Clients get server format after handshake, and they keep it
+		// until they set their own.
+		if (cl->state != RFB_NORMAL)
+			cl->format = screen->serverFormat;
+		rfbSetTranslateFunction(cl);
+	}
+	rfbReleaseClientIterator(it);
+}
+
 static void on_client_gone(rfbClientRec *client)
 {
 	RfLVNCServer *this = client->screen->screenData;
@@ -90,6 +243,7 @@ static void on_pointer_event(int mask, int x, int y, rfbClientRec *client)
 	const double rx = (double)x / this->width;
 	const double ry = (double)y / this->height;
 
+	this->pointer_time = g_get_monotonic_time();
 	rf_vnc_server_handle_pointer_event(super, rx, ry, mask);
 }
 
@@ -270,17 +424,18 @@ static void stop(RfVNCServer *super)
 	g_socket_service_stop(this->service);
 	g_socket_listener_close(G_SOCKET_LISTENER(this->service));
 	g_clear_object(&this->service);
-	g_clear_pointer(&this->buf, g_byte_array_unref);
+	g_clear_pointer(&this->buf, g_bytes_unref);
+	g_clear_pointer(&this->cursor, g_byte_array_unref);
 	g_clear_pointer(&this->desktop_name, g_free);
 	g_clear_pointer(&this->passwords[0], g_free);
 }
 
 static void
 update(RfVNCServer *super,
-       GByteArray *buf,
+       GBytes *buf,
        unsigned int width,
        unsigned int height,
-       const struct rf_rect *damage)
+       const struct rf_region *damage)
 {
 	RfLVNCServer *this = RF_LVNC_SERVER(super);
 
@@ -290,42 +445,146 @@ update(RfVNCServer *super,
 	if (buf == NULL)
 		goto out;
 
-	if (this->buf != buf || this->width != width || this->height != height) {
-		if (this->buf != buf) {
-			g_clear_pointer(&this->buf, g_byte_array_unref);
-			this->buf = g_byte_array_ref(buf);
-		}
+	const bool changed = this->buf == NULL || this->width != width ||
+			     this->height != height ||
+			     this->format != this->next_format;
+	if (this->buf != buf) {
+		g_clear_pointer(&this->buf, g_bytes_unref);
+		this->buf = g_bytes_ref(buf);
+	}
+	if (changed) {
 		if (this->width != width || this->height != height) {
 			this->width = width;
 			this->height = height;
 		}
-		rfbNewFramebuffer(
-			this->screen,
-			(char *)this->buf->data,
-			this->width,
-			this->height,
-			8,
-			3,
-			RF_BYTES_PER_PIXEL
-		);
+		const bool format_changed = this->format != this->next_format;
+		this->format = this->next_format;
+		set_framebuffer(this);
+		if (format_changed)
+			set_cursor(this);
+	} else {
+		// Every buffer holds a whole frame in the same layout, so only
+		// swapping the pointer is enough. rfbNewFramebuffer() makes
+		// clients get a full update.
+		this->screen->frameBuffer =
+			(char *)g_bytes_get_data(this->buf, NULL);
 	}
 
-	if (damage != NULL)
-		rfbMarkRectAsModified(
-			this->screen,
-			damage->x,
-			damage->y,
-			damage->x + damage->w,
-			damage->y + damage->h
-		);
-	else
+	if (damage != NULL) {
+		sraRegionPtr region = sraRgnCreate();
+		for (unsigned int i = 0; i < damage->length; ++i) {
+			const struct rf_rect *rect = &damage->rects[i];
+			sraRegionPtr r = sraRgnCreateRect(
+				rect->x,
+				rect->y,
+				rect->x + rect->w,
+				rect->y + rect->h
+			);
+			sraRgnOr(region, r);
+			sraRgnDestroy(r);
+		}
+		rfbMarkRegionAsModified(this->screen, region);
+		sraRgnDestroy(region);
+	} else {
 		rfbMarkRectAsModified(
 			this->screen, 0, 0, this->width, this->height
 		);
+	}
 out:
 	rfbProcessEvents(this->screen, 0);
 }
 
+static void update_cursor(
+	RfVNCServer *super,
+	GByteArray *buf,
+	unsigned int width,
+	unsigned int height,
+	unsigned int hotspot_x,
+	unsigned int hotspot_y
+)
+{
+	RfLVNCServer *this = RF_LVNC_SERVER(super);
+
+	if (this->screen == NULL || !rfbIsActive(this->screen))
+		return;
+
+	g_clear_pointer(&this->cursor, g_byte_array_unref);
+	if (buf != NULL) {
+		// Converter only allocates buffers, their length is not set.
+		const size_t size = width * height * RF_BYTES_PER_PIXEL;
+		this->cursor = g_byte_array_sized_new(size);
+		g_byte_array_append(this->cursor, buf->data, size);
+		this->cursor_width = width;
+		this->cursor_height = height;
+		this->hotspot_x = hotspot_x;
+		this->hotspot_y = hotspot_y;
+	}
+	set_cursor(this);
+	rfbProcessEvents(this->screen, 0);
+}
+
+static enum rf_pixel_format get_pixel_format(RfVNCServer *super)
+{
+	RfLVNCServer *this = RF_LVNC_SERVER(super);
+
+	if (this->screen == NULL || !rfbIsActive(this->screen))
+		return this->next_format;
+
+	// Only pack frames if all clients want the same format, otherwise
+	// libvncserver translates RGBX for each of them.
+	enum rf_pixel_format format = RF_PIXEL_FORMAT_RGBX8888;
+	bool first = true;
+	rfbClientIteratorPtr it = rfbGetClientIterator(this->screen);
+	rfbClientRec *cl;
+	while ((cl = rfbClientIteratorNext(it))) {
+		// Clients have not told us their format before this.
+		if (cl->state != RFB_NORMAL)
+			continue;
+		const enum rf_pixel_format f = find_format(&cl->format);
+		if (first) {
+			format = f;
+			first = false;
+		} else if (f != format) {
+			format = RF_PIXEL_FORMAT_RGBX8888;
+			break;
+		}
+	}
+	rfbReleaseClientIterator(it);
+
+	if (format != this->next_format)
+		g_message("VNC: Converting frames to pixel format %d.", format);
+	this->next_format = format;
+	return format;
+}
+
+static void move_cursor(RfVNCServer *super, int x, int y)
+{
+	RfLVNCServer *this = RF_LVNC_SERVER(super);
+
+	if (this->screen == NULL || !rfbIsActive(this->screen))
+		return;
+
+	if (this->screen->cursorX == x && this->screen->cursorY == y)
+		return;
+
+	// libvncserver draws cursor for clients that cannot draw it locally,
+	// and it follows this position.
+	this->screen->cursorX = x;
+	this->screen->cursorY = y;
+	// Cursor lags behind the pointer of the client that is moving it,
+	// sending position back makes the local cursor jump, so only do it if
+	// cursor is moved by others.
+	if (g_get_monotonic_time() - this->pointer_time >=
+	    POINTER_IDLE_INTERVAL) {
+		rfbClientIteratorPtr it = rfbGetClientIterator(this->screen);
+		rfbClientRec *cl;
+		while ((cl = rfbClientIteratorNext(it)))
+			cl->cursorWasMoved = TRUE;
+		rfbReleaseClientIterator(it);
+	}
+	rfbProcessEvents(this->screen, 0);
+}
+
 static void flush(RfVNCServer *super)
 {
 	RfLVNCServer *this = RF_LVNC_SERVER(super);
@@ -394,6 +653,9 @@ static void rf_lvnc_server_class_init(RfLVNCServerClass *klass)
 	v_class->start = start;
 	v_class->stop = stop;
 	v_class->update = update;
+	v_class->update_cursor = update_cursor;
+	v_class->get_pixel_format = get_pixel_format;
+	v_class->move_cursor = move_cursor;
 	v_class->flush = flush;
 	v_class->set_desktop_name = set_desktop_name;
 	v_class->send_clipboard_text = send_clipboard_text;
@@ -411,6 +673,14 @@ static void rf_lvnc_server_init(RfLVNCServer *this)
 	this->desktop_name = NULL;
 	this->width = 0;
 	this->height = 0;
+	this->pointer_time = 0;
+	this->format = RF_PIXEL_FORMAT_RGBX8888;
+	this->next_format = RF_PIXEL_FORMAT_RGBX8888;
+	this->cursor = NULL;
+	this->cursor_width = 0;
+	this->cursor_height = 0;
+	this->hotspot_x = 0;
+	this->hotspot_y = 0;
 }
 
 G_MODULE_EXPORT RfVNCServer *rf_vnc_server_new(RfConfig *config)
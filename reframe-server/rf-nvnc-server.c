@@ -12,7 +12,6 @@
 struct _RfNVNCServer {
 	RfVNCServer parent_instance;
 	RfConfig *config;
-	GByteArray *buf;
 	GIOCondition io_flags;
 	unsigned int aml_id;
 	struct aml *aml;
@@ -356,64 +355,125 @@ static void stop(RfVNCServer *super)
 		aml_unref(this->aml);
 		this->aml = NULL;
 	}
-	g_clear_pointer(&this->buf, g_byte_array_unref);
 	g_clear_pointer(&this->desktop_name, g_free);
 	g_clear_pointer(&this->password, g_free);
 }
 
+static void unref_buffer(void *data)
+{
+	g_bytes_unref(data);
+}
+
 static void
 update(RfVNCServer *super,
-       GByteArray *buf,
+       GBytes *buf,
        unsigned int width,
        unsigned int height,
-       const struct rf_rect *damage)
+       const struct rf_region *damage)
 {
 	RfNVNCServer *this = RF_NVNC_SERVER(super);
 
 	if (buf == NULL)
 		return;
 
-	if (this->buf != buf) {
-		g_clear_pointer(&this->buf, g_byte_array_unref);
-		this->buf = g_byte_array_ref(buf);
-	}
 	if (this->width != width || this->height != height) {
 		this->width = width;
 		this->height = height;
 		// nvnc_display_set_logical_size(this->display, width, height);
 	}
 	struct pixman_region16 region;
-	if (damage != NULL)
-		pixman_region_init_rect(
-			&region, damage->x, damage->y, damage->w, damage->h
-		);
-	else
+	if (damage != NULL) {
+		pixman_region_init(&region);
+		for (unsigned int i = 0; i < damage->length; ++i) {
+			const struct rf_rect *rect = &damage->rects[i];
+			pixman_region_union_rect(
+				&region,
+				&region,
+				rect->x,
+				rect->y,
+				rect->w,
+				rect->h
+			);
+		}
+	} else {
 		pixman_region_init_rect(&region, 0, 0, this->width, this->height);
+	}
 #ifndef NEATVNC_UNSTABLE_API
 	struct nvnc_frame *frame = nvnc_frame_from_raw(
-		this->buf->data,
+		(void *)g_bytes_get_data(buf, NULL),
 		this->width,
 		this->height,
 		DRM_FORMAT_XBGR8888,
 		this->width
 	);
+	// neatvnc encodes frames in worker threads, so the buffer must not be
+	// reused until it drops the frame.
+	nvnc_set_userdata(frame, g_bytes_ref(buf), unref_buffer);
 	nvnc_frame_set_damage(frame, &region);
 	nvnc_display_feed_frame(this->display, frame);
 	nvnc_frame_unref(frame);
 #else
 	struct nvnc_fb *fb = nvnc_fb_from_buffer(
-		this->buf->data,
+		(void *)g_bytes_get_data(buf, NULL),
 		this->width,
 		this->height,
 		DRM_FORMAT_XBGR8888,
 		this->width
 	);
+	nvnc_set_userdata(fb, g_bytes_ref(buf), unref_buffer);
 	nvnc_display_feed_buffer(this->display, fb, &region);
 	nvnc_fb_unref(fb);
 #endif
 	pixman_region_fini(&region);
 }
 
+static void update_cursor(
+	RfVNCServer *super,
+	GByteArray *buf,
+	unsigned int width,
+	unsigned int height,
+	unsigned int hotspot_x,
+	unsigned int hotspot_y
+)
+{
+	RfNVNCServer *this = RF_NVNC_SERVER(super);
+
+	// Clients get an empty cursor.
+	if (buf == NULL) {
+		nvnc_set_cursor(this->nvnc, NULL, 0, 0, 0, 0, true);
+		return;
+	}
+
+	// neatvnc keeps its own reference of cursor, so we copy it.
+#ifndef NEATVNC_UNSTABLE_API
+	struct nvnc_frame *frame =
+		nvnc_frame_new(width, height, DRM_FORMAT_ABGR8888, width);
+	memcpy(nvnc_frame_get_addr(frame),
+	       buf->data,
+	       width * height * RF_BYTES_PER_PIXEL);
+	nvnc_set_cursor(
+		this->nvnc, frame, width, height, hotspot_x, hotspot_y, true
+	);
+	nvnc_frame_unref(frame);
+#else
+	struct nvnc_fb *fb =
+		nvnc_fb_new(width, height, DRM_FORMAT_ABGR8888, width);
+	memcpy(nvnc_fb_get_addr(fb),
+	       buf->data,
+	       width * height * RF_BYTES_PER_PIXEL);
+	nvnc_set_cursor(
+		this->nvnc, fb, width, height, hotspot_x, hotspot_y, true
+	);
+	nvnc_fb_unref(fb);
+#endif
+}
+
+// neatvnc has no cursor position pseudo-encoding, clients draw cursor at their
+// own pointer.
+static void move_cursor(RfVNCServer *super, int x, int y)
+{
+}
+
 static void flush(RfVNCServer *super)
 {
 	RfNVNCServer *this = RF_NVNC_SERVER(super);
@@ -455,6 +515,8 @@ static void rf_nvnc_server_class_init(RfNVNCServerClass *klass)
 	v_class->start = start;
 	v_class->stop = stop;
 	v_class->update = update;
+	v_class->update_cursor = update_cursor;
+	v_class->move_cursor = move_cursor;
 	v_class->flush = flush;
 	v_class->set_desktop_name = set_desktop_name;
 	v_class->send_clipboard_text = send_clipboard_text;
@@ -463,7 +525,6 @@ static void rf_nvnc_server_class_init(RfNVNCServerClass *klass)
 static void rf_nvnc_server_init(RfNVNCServer *this)
 {
 	this->config = NULL;
-	this->buf = NULL;
 	this->io_flags = G_IO_IN | G_IO_PRI;
 	this->aml_id = 0;
 	this->aml = NULL;
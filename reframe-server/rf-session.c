@@ -23,21 +23,18 @@ enum { SIG_START, SIG_STOP, SIG_CLIPBOARD_TEXT, SIG_AUTH, N_SIGS };
 
 static unsigned int sigs[N_SIGS] = { 0 };
 
-static ssize_t
-on_clipboard_text_msg(RfSession *this, GSocketConnection *connection)
+static ssize_t on_clipboard_text_msg(
+	RfSession *this,
+	GSocketConnection *connection,
+	size_t length
+)
 {
 	g_autofree char *msg = NULL;
-	size_t length = 0;
 	ssize_t ret = 0;
 	g_autoptr(GError) error = NULL;
-	GInputStream *is = g_io_stream_get_input_stream(G_IO_STREAM(connection));
-
-	ret = g_input_stream_read(is, &length, sizeof(length), NULL, &error);
-	if (ret <= 0)
-		goto out;
 
 	msg = g_malloc0(length);
-	ret = g_input_stream_read(is, msg, length, NULL, &error);
+	ret = rf_receive_payload(connection, msg, length, &error);
 	if (ret <= 0)
 		goto out;
 
@@ -63,14 +60,14 @@ static int on_socket_in(GSocket *socket, GIOCondition condition, void *data)
 	ssize_t ret = 0;
 	g_autoptr(GError) error = NULL;
 	char type;
+	size_t length = 0;
 	g_autoptr(GSocketConnection) connection =
 		g_socket_connection_factory_create_connection(socket);
-	GInputStream *is = g_io_stream_get_input_stream(G_IO_STREAM(connection));
-	ret = g_input_stream_read(is, &type, sizeof(type), NULL, &error);
+	ret = rf_receive_header(connection, &type, &length, NULL, NULL, &error);
 	if (ret <= 0) {
 		if (ret < 0)
 			g_warning(
-				"Failed to read message type: %s.",
+				"Failed to read message header: %s.",
 				error->message
 			);
 		goto out;
@@ -78,7 +75,7 @@ static int on_socket_in(GSocket *socket, GIOCondition condition, void *data)
 
 	switch (type) {
 	case RF_MSG_TYPE_CLIPBOARD_TEXT:
-		ret = on_clipboard_text_msg(this, connection);
+		ret = on_clipboard_text_msg(this, connection, length);
 		break;
 	default:
 		break;
@@ -302,15 +299,16 @@ void rf_session_send_clipboard_text_msg(RfSession *this, const char *text)
 		g_autoptr(GError) error = NULL;
 		GSocketConnection *connection =
 			g_socket_connection_factory_create_connection(key);
-		GOutputStream *os =
-			g_io_stream_get_output_stream(G_IO_STREAM(connection));
-		ret = rf_send_header(
-			connection, RF_MSG_TYPE_CLIPBOARD_TEXT, length, &error
+		ret = rf_send_msg(
+			connection,
+			RF_MSG_TYPE_CLIPBOARD_TEXT,
+			length,
+			text,
+			length,
+			NULL,
+			0,
+			&error
 		);
-		if (ret <= 0)
-			goto next;
-		ret = g_output_stream_write(os, text, length, NULL, &error);
-	next:
 		if (ret <= 0) {
 			if (ret < 0)
 				g_warning(
@@ -1,7 +1,8 @@
 #include <stdint.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <sys/socket.h>
 #include <gio/gio.h>
-#include <gio/gunixfdmessage.h>
 #include <gio/gunixsocketaddress.h>
 #include <linux/uinput.h>
 
@@ -16,11 +17,15 @@ struct _RfStreamer {
 	RfConfig *config;
 	GSocketAddress *address;
 	GSocketConnection *connection;
+	// Streamer handles input in another thread via this channel.
+	GSocketConnection *input_connection;
 	GIOCondition io_flags;
 	GSource *source;
 	unsigned int timer_id;
 	int64_t last_frame_time;
 	int64_t max_interval;
+	bool push;
+	bool refresh;
 	unsigned int desktop_width;
 	unsigned int desktop_height;
 	int monitor_x;
@@ -29,6 +34,9 @@ struct _RfStreamer {
 	// These are the real size of monitor and have nothing with VNC.
 	uint32_t frame_width;
 	uint32_t frame_height;
+	// Streamer only sends fds when registering framebuffers, we own them
+	// until the slot is reused.
+	struct rf_buffer slots[RF_MAX_SLOTS];
 	bool running;
 };
 G_DEFINE_TYPE(RfStreamer, rf_streamer, G_TYPE_SOCKET_CLIENT)
@@ -49,15 +57,17 @@ static void send_auth_msg(RfStreamer *this, pid_t pid)
 {
 	ssize_t ret = 0;
 	g_autoptr(GError) error = NULL;
-	GOutputStream *os =
-		g_io_stream_get_output_stream(G_IO_STREAM(this->connection));
 
-	ret = rf_send_header(this->connection, RF_MSG_TYPE_AUTH, 1, &error);
-	if (ret <= 0)
-		goto out;
-	ret = g_output_stream_write(os, &pid, sizeof(pid), NULL, &error);
-
-out:
+	ret = rf_send_msg(
+		this->connection,
+		RF_MSG_TYPE_AUTH,
+		1,
+		&pid,
+		sizeof(pid),
+		NULL,
+		0,
+		&error
+	);
 	if (ret < 0) {
 		g_warning("Auth: Failed to send auth PID: %s.", error->message);
 		rf_streamer_stop(this);
@@ -69,20 +79,107 @@ out:
 	}
 }
 
+static void send_connector_name_msg(RfStreamer *this, const char *connector_name)
+{
+	ssize_t ret = 0;
+	size_t length = strlen(connector_name) + 1;
+	g_autoptr(GError) error = NULL;
+
+	ret = rf_send_msg(
+		this->connection,
+		RF_MSG_TYPE_CONNECTOR_NAME,
+		length,
+		connector_name,
+		length,
+		NULL,
+		0,
+		&error
+	);
+	if (ret < 0) {
+		g_warning(
+			"DRM: Failed to send connector name: %s.", error->message
+		);
+		rf_streamer_stop(this);
+	} else if (ret == 0) {
+		g_warning("ReFrame Streamer disconnected.");
+		rf_streamer_stop(this);
+	} else {
+		g_debug("DRM: Sent connector name %s.", connector_name);
+	}
+}
+
+// Input goes through its own channel, so Streamer never delays it behind
+// exporting framebuffers. We send the other end of a socket pair to Streamer.
+static void send_input_channel_msg(RfStreamer *this)
+{
+	ssize_t ret = 0;
+	g_autoptr(GError) error = NULL;
+	g_autoptr(GSocket) socket = NULL;
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+		g_warning(
+			"Input: Failed to create input channel: %s.",
+			strerror(errno)
+		);
+		return;
+	}
+	socket = g_socket_new_from_fd(fds[0], &error);
+	if (socket == NULL) {
+		g_warning(
+			"Input: Failed to create input channel: %s.",
+			error->message
+		);
+		close(fds[0]);
+		close(fds[1]);
+		return;
+	}
+
+	// This takes the ownership of the other end.
+	ret = rf_send_msg(
+		this->connection,
+		RF_MSG_TYPE_INPUT_CHANNEL,
+		1,
+		NULL,
+		0,
+		&fds[1],
+		1,
+		&error
+	);
+	if (ret < 0) {
+		g_warning(
+			"Input: Failed to send input channel: %s.",
+			error->message
+		);
+		rf_streamer_stop(this);
+	} else if (ret == 0) {
+		g_warning("ReFrame Streamer disconnected.");
+		rf_streamer_stop(this);
+	} else {
+		this->input_connection =
+			g_socket_connection_factory_create_connection(socket);
+		g_debug("Input: Sent input channel.");
+	}
+}
+
 static void
 send_input_msg(RfStreamer *this, struct input_event *ies, const size_t length)
 {
 	ssize_t ret = 0;
 	g_autoptr(GError) error = NULL;
-	GOutputStream *os =
-		g_io_stream_get_output_stream(G_IO_STREAM(this->connection));
 
-	ret = rf_send_header(this->connection, RF_MSG_TYPE_INPUT, length, &error);
-	if (ret <= 0)
-		goto out;
-	ret = g_output_stream_write(os, ies, length * sizeof(*ies), NULL, &error);
-
-out:
+	// Fallback to the main connection if we failed to create channel.
+	ret = rf_send_msg(
+		this->input_connection != NULL ? this->input_connection :
+						 this->connection,
+		RF_MSG_TYPE_INPUT,
+		length,
+		ies,
+		length * sizeof(*ies),
+		NULL,
+		0,
+		&error
+	);
 	if (ret < 0) {
 		g_warning(
 			"Input: Failed to send input events: %s.", error->message
@@ -103,7 +200,16 @@ static int send_frame_msg(void *data)
 	RfStreamer *this = data;
 	ssize_t ret = 0;
 	g_autoptr(GError) error = NULL;
-	ret = rf_send_header(this->connection, RF_MSG_TYPE_FRAME, 0, &error);
+	ret = rf_send_msg(
+		this->connection,
+		RF_MSG_TYPE_FRAME,
+		this->refresh ? 1 : 0,
+		NULL,
+		0,
+		NULL,
+		0,
+		&error
+	);
 	if (ret < 0) {
 		g_warning(
 			"Frame: Failed to send frame message: %s.",
@@ -113,6 +219,7 @@ static int send_frame_msg(void *data)
 	} else if (ret > 0) {
 		this->last_frame_time = g_get_monotonic_time();
 		this->timer_id = 0;
+		this->refresh = false;
 	} else {
 		g_warning("ReFrame Streamer disconnected.");
 		rf_streamer_stop(this);
@@ -137,7 +244,9 @@ static void schedule_frame_msg(RfStreamer *this)
 			NULL
 		);
 	} else {
-		if (this->last_frame_time != -1)
+		// In push mode streamer holds the request until the next
+		// change, so it is expected to be slow.
+		if (this->last_frame_time != -1 && !this->push)
 			g_warning(
 				"Frame: Converted frame too slow, expected %ldms, used %ldms.",
 				this->max_interval / 1000,
@@ -149,111 +258,127 @@ static void schedule_frame_msg(RfStreamer *this)
 	}
 }
 
-static ssize_t
-on_buffer(GSocketConnection *connection, struct rf_buffer *b, GError **error)
+static void clean_slot(struct rf_buffer *slot)
 {
-	ssize_t ret = 0;
-	GSocket *socket = g_socket_connection_get_socket(connection);
-	GInputVector iov = { &b->md, sizeof(b->md) };
-	g_autofree GSocketControlMessage **msgs = NULL;
-	int n_msgs = 0;
-
-	b->md.length = 0;
+	for (unsigned int i = 0; i < slot->md.length; ++i)
+		if (slot->fds[i] >= 0)
+			close(slot->fds[i]);
+	slot->md.length = 0;
 	for (int i = 0; i < RF_MAX_FDS; ++i)
-		b->fds[i] = -1;
+		slot->fds[i] = -1;
+}
 
-	ret = g_socket_receive_message(
-		socket, NULL, &iov, 1, &msgs, &n_msgs, NULL, NULL, error
-	);
-	if (ret <= 0)
-		return ret;
+static void clean_slots(RfStreamer *this)
+{
+	for (int i = 0; i < RF_MAX_SLOTS; ++i)
+		clean_slot(&this->slots[i]);
+}
 
-	// We should only receive 1 message each time.
-	if (n_msgs != 1) {
+// Slots own all fds, fds in buffer are borrowed from slot. fds of uncached
+// buffers come in order with the message.
+static int on_buffer(
+	RfStreamer *this,
+	struct rf_buffer *b,
+	int *fds,
+	int n_fds,
+	int *used,
+	GError **error
+)
+{
+	if (b->md.slot >= RF_MAX_SLOTS || b->md.length > RF_MAX_FDS) {
 		g_set_error(
 			error,
 			G_IO_ERROR,
 			G_IO_ERROR_INVALID_DATA,
-			"Expect 1 fd message but got %d",
-			n_msgs
+			"Got invalid slot %u",
+			b->md.slot
 		);
-		ret = -2;
-		goto out;
+		return -2;
 	}
+	struct rf_buffer *slot = &this->slots[b->md.slot];
 
-	if (!G_IS_UNIX_FD_MESSAGE(msgs[n_msgs - 1])) {
-		g_set_error(
-			error,
-			G_IO_ERROR,
-			G_IO_ERROR_INVALID_DATA,
-			"Failed to get fd message"
-		);
-		ret = -2;
-		goto out;
-	}
+	for (int i = 0; i < RF_MAX_FDS; ++i)
+		b->fds[i] = -1;
 
-	// We don't need to free GUnixFDList because
-	// GUnixFDMessage does not return a reference so we
-	// are not taking ownership of it.
-	//
-	// See <https://docs.gtk.org/gio-unix/type_func.FDMessage.get_fd_list.html>.
-	GUnixFDMessage *msg = G_UNIX_FD_MESSAGE(msgs[n_msgs - 1]);
-	GUnixFDList *fds = g_unix_fd_message_get_fd_list(msg);
-	for (unsigned int i = 0; i < b->md.length; ++i) {
-		b->fds[i] = g_unix_fd_list_get(fds, i, NULL);
-		// Some error happens.
-		if (b->fds[i] == -1) {
+	if (b->md.cached) {
+		if (slot->md.length != b->md.length) {
 			g_set_error(
 				error,
 				G_IO_ERROR,
 				G_IO_ERROR_INVALID_DATA,
-				"Expect %d fds but got %d.",
-				b->md.length,
-				i
+				"Got cached buffer for invalid slot %u",
+				b->md.slot
 			);
-			b->md.length = i;
-			ret = -2;
-			goto out;
+			return -2;
 		}
+		for (unsigned int i = 0; i < b->md.length; ++i)
+			b->fds[i] = slot->fds[i];
+		rf_buffer_debug(b);
+		return 0;
 	}
-	rf_buffer_debug(b);
-
-out:
-	for (int i = 0; i < n_msgs; ++i)
-		g_clear_object(&msgs[i]);
 
-	return ret;
+	if (n_fds - *used < (int)b->md.length) {
+		g_set_error(
+			error,
+			G_IO_ERROR,
+			G_IO_ERROR_INVALID_DATA,
+			"Expect %u fds but got %d",
+			b->md.length,
+			n_fds - *used
+		);
+		return -2;
+	}
+	clean_slot(slot);
+	slot->md = b->md;
+	for (unsigned int i = 0; i < b->md.length; ++i) {
+		b->fds[i] = fds[*used];
+		slot->fds[i] = fds[*used];
+		// Ownership is passed to slot.
+		fds[(*used)++] = -1;
+	}
+	rf_buffer_debug(b);
+	return 0;
 }
 
-static ssize_t on_frame_msg(RfStreamer *this)
+static ssize_t
+on_frame_msg(RfStreamer *this, size_t length, int *fds, int n_fds)
 {
 	g_debug("Frame: Received frame message.");
 
 	struct rf_buffer bufs[RF_MAX_BUFS];
-	ssize_t ret = 0;
-	size_t length = 0;
+	struct rf_buffer_metadata mds[RF_MAX_BUFS];
+	ssize_t ret = 1;
+	int used = 0;
 	g_autoptr(GError) error = NULL;
-	GInputStream *is =
-		g_io_stream_get_input_stream(G_IO_STREAM(this->connection));
 
-	ret = g_input_stream_read(is, &length, sizeof(length), NULL, &error);
-	if (ret <= 0) {
-		length = 0;
-		goto out;
-	}
 	// Empty buffer, maybe locked screen and turned monitor off, skip it.
 	if (length == 0) {
 		g_debug("Frame: Got empty buffer for primary plane.");
 		goto out;
 	} else if (length > RF_MAX_BUFS) {
-		g_warning("Frame: Got invalid buffers length %ld.", length);
+		g_set_error(
+			&error,
+			G_IO_ERROR,
+			G_IO_ERROR_INVALID_DATA,
+			"Got invalid buffers length %ld",
+			length
+		);
+		ret = -2;
 		goto out;
 	}
 
+	ret = rf_receive_payload(
+		this->connection, mds, length * sizeof(*mds), &error
+	);
+	if (ret <= 0)
+		goto out;
+
 	for (size_t i = 0; i < length; ++i) {
-		ret = on_buffer(this->connection, &bufs[i], &error);
-		if (ret <= 0)
+		bufs[i].md = mds[i];
+		if (on_buffer(this, &bufs[i], fds, n_fds, &used, &error) < 0) {
+			ret = -2;
 			goto out;
+		}
 	}
 
 	struct rf_buffer *primary = &bufs[0];
@@ -273,10 +398,10 @@ static ssize_t on_frame_msg(RfStreamer *this)
 	g_signal_emit(this, sigs[SIG_FRAME], 0, length, bufs);
 
 out:
-	for (size_t i = 0; i < length; ++i)
-		for (unsigned int j = 0; j < bufs[i].md.length; ++j)
-			close(bufs[i].fds[j]);
-
+	// Unused fds, should not happen with a sane Streamer.
+	for (int i = used; i < n_fds; ++i)
+		if (fds[i] >= 0)
+			close(fds[i]);
 	if (ret < 0)
 		g_warning("Frame: Failed to receive frame: %s.", error->message);
 	else if (ret > 0)
@@ -284,21 +409,21 @@ out:
 	return ret;
 }
 
-static ssize_t on_card_path_msg(RfStreamer *this)
+static ssize_t on_frame_unchanged_msg(RfStreamer *this)
+{
+	g_debug("Frame: Received frame unchanged message.");
+	schedule_frame_msg(this);
+	return 1;
+}
+
+static ssize_t on_card_path_msg(RfStreamer *this, size_t length)
 {
 	g_autofree char *msg = NULL;
 	ssize_t ret = 0;
-	size_t length = 0;
 	g_autoptr(GError) error = NULL;
-	GInputStream *is =
-		g_io_stream_get_input_stream(G_IO_STREAM(this->connection));
-
-	ret = g_input_stream_read(is, &length, sizeof(length), NULL, &error);
-	if (ret <= 0)
-		goto out;
 
 	msg = g_malloc0(length);
-	ret = g_input_stream_read(is, msg, length, NULL, &error);
+	ret = rf_receive_payload(this->connection, msg, length, &error);
 	if (ret <= 0)
 		goto out;
 
@@ -314,21 +439,14 @@ out:
 	return ret;
 }
 
-static ssize_t on_connector_name_msg(RfStreamer *this)
+static ssize_t on_connector_name_msg(RfStreamer *this, size_t length)
 {
 	g_autofree char *msg = NULL;
-	size_t length = 0;
 	ssize_t ret = 0;
 	g_autoptr(GError) error = NULL;
-	GInputStream *is =
-		g_io_stream_get_input_stream(G_IO_STREAM(this->connection));
-
-	ret = g_input_stream_read(is, &length, sizeof(length), NULL, &error);
-	if (ret <= 0)
-		goto out;
 
 	msg = g_malloc0(length);
-	ret = g_input_stream_read(is, msg, length, NULL, &error);
+	ret = rf_receive_payload(this->connection, msg, length, &error);
 	if (ret <= 0)
 		goto out;
 
@@ -345,20 +463,16 @@ out:
 	return ret;
 }
 
-static ssize_t on_auth_msg(RfStreamer *this)
+static ssize_t on_auth_msg(RfStreamer *this, size_t length)
 {
 	struct rf_auth auth;
-	size_t length = 0;
 	ssize_t ret = 0;
 	g_autoptr(GError) error = NULL;
-	GInputStream *is =
-		g_io_stream_get_input_stream(G_IO_STREAM(this->connection));
 
-	ret = g_input_stream_read(is, &length, sizeof(length), NULL, &error);
-	if (ret <= 0 || length != 1)
+	if (length != 1)
 		goto out;
 
-	ret = g_input_stream_read(is, &auth, sizeof(auth), NULL, &error);
+	ret = rf_receive_payload(this->connection, &auth, sizeof(auth), &error);
 	if (ret <= 0 || auth.pid < 0)
 		goto out;
 
@@ -385,14 +499,17 @@ static int on_socket_in(GSocket *socket, GIOCondition condition, void *data)
 
 	ssize_t ret = 0;
 	g_autoptr(GError) error = NULL;
-	GInputStream *is =
-		g_io_stream_get_input_stream(G_IO_STREAM(this->connection));
+	g_autofree int *fds = NULL;
+	int n_fds = 0;
 	char type;
-	ret = g_input_stream_read(is, &type, sizeof(type), NULL, &error);
+	size_t length = 0;
+	ret = rf_receive_header(
+		this->connection, &type, &length, &fds, &n_fds, &error
+	);
 	if (ret <= 0) {
 		if (ret < 0)
 			g_warning(
-				"Failed to read message type: %s.",
+				"Failed to read message header: %s.",
 				error->message
 			);
 		goto out;
@@ -400,20 +517,27 @@ static int on_socket_in(GSocket *socket, GIOCondition condition, void *data)
 
 	switch (type) {
 	case RF_MSG_TYPE_FRAME:
-		ret = on_frame_msg(this);
+		ret = on_frame_msg(this, length, fds, n_fds);
+		n_fds = 0;
+		break;
+	case RF_MSG_TYPE_FRAME_UNCHANGED:
+		ret = on_frame_unchanged_msg(this);
 		break;
 	case RF_MSG_TYPE_CARD_PATH:
-		ret = on_card_path_msg(this);
+		ret = on_card_path_msg(this, length);
 		break;
 	case RF_MSG_TYPE_CONNECTOR_NAME:
-		ret = on_connector_name_msg(this);
+		ret = on_connector_name_msg(this, length);
 		break;
 	case RF_MSG_TYPE_AUTH:
-		ret = on_auth_msg(this);
+		ret = on_auth_msg(this, length);
 		break;
 	default:
 		break;
 	}
+	// Only frame message carries fds.
+	for (int i = 0; i < n_fds; ++i)
+		close(fds[i]);
 
 out:
 	if (ret <= 0) {
@@ -504,11 +628,14 @@ static void rf_streamer_init(RfStreamer *this)
 	this->config = NULL;
 	this->address = NULL;
 	this->connection = NULL;
+	this->input_connection = NULL;
 	this->io_flags = G_IO_IN | G_IO_PRI;
 	this->source = NULL;
 	this->timer_id = 0;
 	this->last_frame_time = -1;
 	this->max_interval = 1000000 / 30;
+	this->push = false;
+	this->refresh = false;
 	this->desktop_width = 0;
 	this->desktop_height = 0;
 	this->monitor_x = 0;
@@ -516,6 +643,11 @@ static void rf_streamer_init(RfStreamer *this)
 	this->rotation = 0;
 	this->frame_width = 0;
 	this->frame_height = 0;
+	for (int i = 0; i < RF_MAX_SLOTS; ++i) {
+		this->slots[i].md.length = 0;
+		for (int j = 0; j < RF_MAX_FDS; ++j)
+			this->slots[i].fds[j] = -1;
+	}
 	this->running = false;
 }
 
@@ -546,6 +678,8 @@ int rf_streamer_start(RfStreamer *this)
 	const unsigned int fps = rf_config_get_fps(this->config);
 	this->max_interval = 1000000 / fps;
 	g_message("Frame: Got FPS %u.", fps);
+	this->push = rf_config_get_push(this->config);
+	this->refresh = false;
 	this->desktop_width = rf_config_get_desktop_width(this->config);
 	this->desktop_height = rf_config_get_desktop_height(this->config);
 	g_message(
@@ -585,9 +719,23 @@ int rf_streamer_start(RfStreamer *this)
 		this->source, G_SOURCE_FUNC(on_socket_in), this, NULL
 	);
 	g_source_attach(this->source, NULL);
-	schedule_frame_msg(this);
 
 	this->running = true;
+	// Streamer may capture many connectors for different Servers, so we
+	// tell it which one we want before requesting frames. Empty name means
+	// using Streamer's configuration.
+	g_autofree char *connector_name =
+		rf_config_get_connector(this->config);
+	send_connector_name_msg(
+		this, connector_name != NULL ? connector_name : ""
+	);
+	if (!this->running)
+		return -2;
+	send_input_channel_msg(this);
+	if (!this->running)
+		return -2;
+	schedule_frame_msg(this);
+
 	g_debug("Signal: Emitting ReFrame Streamer start signal.");
 	g_signal_emit(this, sigs[SIG_START], 0);
 	return 0;
@@ -620,7 +768,23 @@ void rf_streamer_stop(RfStreamer *this)
 	}
 	// Dropping the last reference of it will automatically close IO streams
 	// and socket.
+	g_clear_object(&this->input_connection);
 	g_clear_object(&this->connection);
+	clean_slots(this);
+}
+
+void rf_streamer_refresh(RfStreamer *this)
+{
+	g_return_if_fail(RF_IS_STREAMER(this));
+
+	if (!this->running)
+		return;
+
+	this->refresh = true;
+	// In push mode Streamer may hold the pending request until next change,
+	// so send another one to make it reply now.
+	if (this->push && this->timer_id == 0)
+		send_frame_msg(this);
 }
 
 static inline int down_or_up(bool b)
@@ -17,6 +17,7 @@ void rf_streamer_set_socket_path(RfStreamer *this, const char *socket_path);
 int rf_streamer_start(RfStreamer *this);
 bool rf_streamer_is_running(RfStreamer *this);
 void rf_streamer_stop(RfStreamer *this);
+void rf_streamer_refresh(RfStreamer *this);
 void rf_streamer_send_keyboard_event(
 	RfStreamer *this,
 	uint32_t keycode,
@@ -82,6 +82,7 @@ static void rf_vnc_server_class_init(RfVNCServerClass *klass)
 	klass->set_desktop_name = NULL;
 	klass->send_clipboard_text = NULL;
 	klass->update = NULL;
+	klass->get_pixel_format = NULL;
 	klass->flush = NULL;
 
 	sigs[SIG_FIRST_CLIENT] = g_signal_new(
@@ -255,10 +256,10 @@ void rf_vnc_server_send_clipboard_text(RfVNCServer *this, const char *text)
 
 void rf_vnc_server_update(
 	RfVNCServer *this,
-	GByteArray *buf,
+	GBytes *buf,
 	unsigned int width,
 	unsigned int height,
-	const struct rf_rect *damage
+	const struct rf_region *damage
 )
 {
 	g_return_if_fail(RF_IS_VNC_SERVER(this));
@@ -276,6 +277,58 @@ void rf_vnc_server_update(
 	klass->update(this, buf, width, height, damage);
 }
 
+void rf_vnc_server_update_cursor(
+	RfVNCServer *this,
+	GByteArray *buf,
+	unsigned int width,
+	unsigned int height,
+	unsigned int hotspot_x,
+	unsigned int hotspot_y
+)
+{
+	g_return_if_fail(RF_IS_VNC_SERVER(this));
+
+	RfVNCServerClass *klass = RF_VNC_SERVER_GET_CLASS(this);
+
+	g_return_if_fail(klass->update_cursor != NULL);
+
+	RfVNCServerPrivate *priv = rf_vnc_server_get_instance_private(this);
+
+	if (!priv->running)
+		return;
+
+	klass->update_cursor(this, buf, width, height, hotspot_x, hotspot_y);
+}
+
+enum rf_pixel_format rf_vnc_server_get_pixel_format(RfVNCServer *this)
+{
+	g_return_val_if_fail(RF_IS_VNC_SERVER(this), RF_PIXEL_FORMAT_RGBX8888);
+
+	RfVNCServerClass *klass = RF_VNC_SERVER_GET_CLASS(this);
+	RfVNCServerPrivate *priv = rf_vnc_server_get_instance_private(this);
+
+	if (!priv->running || klass->get_pixel_format == NULL)
+		return RF_PIXEL_FORMAT_RGBX8888;
+
+	return klass->get_pixel_format(this);
+}
+
+void rf_vnc_server_move_cursor(RfVNCServer *this, int x, int y)
+{
+	g_return_if_fail(RF_IS_VNC_SERVER(this));
+
+	RfVNCServerClass *klass = RF_VNC_SERVER_GET_CLASS(this);
+
+	g_return_if_fail(klass->move_cursor != NULL);
+
+	RfVNCServerPrivate *priv = rf_vnc_server_get_instance_private(this);
+
+	if (!priv->running)
+		return;
+
+	klass->move_cursor(this, x, y);
+}
+
 void rf_vnc_server_flush(RfVNCServer *this)
 {
 	g_return_if_fail(RF_IS_VNC_SERVER(this));
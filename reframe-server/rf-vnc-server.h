@@ -31,16 +31,44 @@ struct _RfVNCServerClass {
 	 * Update the VNC buffer and state.
 	 *
 	 * If @buf is %NULL, you should ignore it, and update the VNC state only.
+	 * Otherwise it is a whole frame, take a reference if you still read it
+	 * after returning, the buffer won't be reused before you drop it.
 	 *
 	 * If @damage is %NULL, the whole buffer is damaged.
 	 */
 	void (*update)(
+		RfVNCServer *this,
+		GBytes *buf,
+		unsigned int width,
+		unsigned int height,
+		const struct rf_region *damage
+	);
+	/**
+	 * Update the cursor shape that clients draw locally.
+	 *
+	 * @buf is RGBA with alpha, if @buf is %NULL, cursor is hidden.
+	 */
+	void (*update_cursor)(
 		RfVNCServer *this,
 		GByteArray *buf,
 		unsigned int width,
 		unsigned int height,
-		const struct rf_rect *damage
+		unsigned int hotspot_x,
+		unsigned int hotspot_y
 	);
+	/**
+	 * Get the pixel format that all clients want, so frames in it need no
+	 * translation.
+	 *
+	 * Buffers passed to update() after this are in the returned format.
+	 * This is optional, frames are in %RF_PIXEL_FORMAT_RGBX8888 if not
+	 * implemented.
+	 */
+	enum rf_pixel_format (*get_pixel_format)(RfVNCServer *this);
+	/**
+	 * Move the hotspot of cursor to @x and @y.
+	 */
+	void (*move_cursor)(RfVNCServer *this, int x, int y);
 	/**
 	 * Disconnect all VNC connections.
 	 */
@@ -54,12 +82,22 @@ typedef RfVNCServer *(*RfVNCServerNew)(RfConfig *config);
 void rf_vnc_server_start(RfVNCServer *this);
 void rf_vnc_server_stop(RfVNCServer *this);
 void rf_vnc_server_update(
+	RfVNCServer *this,
+	GBytes *buf,
+	unsigned int width,
+	unsigned int height,
+	const struct rf_region *damage
+);
+void rf_vnc_server_update_cursor(
 	RfVNCServer *this,
 	GByteArray *buf,
 	unsigned int width,
 	unsigned int height,
-	const struct rf_rect *damage
+	unsigned int hotspot_x,
+	unsigned int hotspot_y
 );
+enum rf_pixel_format rf_vnc_server_get_pixel_format(RfVNCServer *this);
+void rf_vnc_server_move_cursor(RfVNCServer *this, int x, int y);
 void rf_vnc_server_flush(RfVNCServer *this);
 void rf_vnc_server_set_desktop_name(RfVNCServer *this, const char *desktop_name);
 void rf_vnc_server_send_clipboard_text(RfVNCServer *this, const char *text);
@@ -30,17 +30,16 @@ send_clipboard_text_msg(struct this *this, const char *clipboard_text)
 		g_autoptr(GError) error = NULL;
 		GSocketConnection *connection =
 			g_socket_connection_factory_create_connection(key);
-		GOutputStream *os =
-			g_io_stream_get_output_stream(G_IO_STREAM(connection));
-		ret = rf_send_header(
-			connection, RF_MSG_TYPE_CLIPBOARD_TEXT, length, &error
+		ret = rf_send_msg(
+			connection,
+			RF_MSG_TYPE_CLIPBOARD_TEXT,
+			length,
+			clipboard_text,
+			length,
+			NULL,
+			0,
+			&error
 		);
-		if (ret <= 0)
-			goto next;
-		ret = g_output_stream_write(
-			os, clipboard_text, length, NULL, &error
-		);
-	next:
 		if (ret <= 0) {
 			if (ret < 0)
 				g_warning(
@@ -87,21 +86,18 @@ static void on_clipboard_changed(GdkClipboard *clipboard, void *data)
 	gdk_clipboard_read_text_async(clipboard, NULL, on_read_text_finish, this);
 }
 
-static ssize_t
-on_clipboard_text_msg(struct this *this, GSocketConnection *connection)
+static ssize_t on_clipboard_text_msg(
+	struct this *this,
+	GSocketConnection *connection,
+	size_t length
+)
 {
 	g_autofree char *msg = NULL;
-	size_t length = 0;
 	ssize_t ret = 0;
 	g_autoptr(GError) error = NULL;
-	GInputStream *is = g_io_stream_get_input_stream(G_IO_STREAM(connection));
-
-	ret = g_input_stream_read(is, &length, sizeof(length), NULL, &error);
-	if (ret <= 0)
-		goto out;
 
 	msg = g_malloc0(length);
-	ret = g_input_stream_read(is, msg, length, NULL, &error);
+	ret = rf_receive_payload(connection, msg, length, &error);
 	if (ret <= 0)
 		goto out;
 
@@ -127,14 +123,14 @@ static int on_socket_in(GSocket *socket, GIOCondition condition, void *data)
 	ssize_t ret = 0;
 	g_autoptr(GError) error = NULL;
 	char type;
+	size_t length = 0;
 	g_autoptr(GSocketConnection) connection =
 		g_socket_connection_factory_create_connection(socket);
-	GInputStream *is = g_io_stream_get_input_stream(G_IO_STREAM(connection));
-	ret = g_input_stream_read(is, &type, sizeof(type), NULL, &error);
+	ret = rf_receive_header(connection, &type, &length, NULL, NULL, &error);
 	if (ret <= 0) {
 		if (ret < 0)
 			g_warning(
-				"Failed to read message type: %s.",
+				"Failed to read message header: %s.",
 				error->message
 			);
 		goto out;
@@ -142,7 +138,7 @@ static int on_socket_in(GSocket *socket, GIOCondition condition, void *data)
 
 	switch (type) {
 	case RF_MSG_TYPE_CLIPBOARD_TEXT:
-		ret = on_clipboard_text_msg(this, connection);
+		ret = on_clipboard_text_msg(this, connection, length);
 		break;
 	default:
 		break;
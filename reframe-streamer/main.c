@@ -1,16 +1,17 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <locale.h>
+#include <poll.h>
 #include <glib.h>
 #include <glib-unix.h>
 #include <glib/gstdio.h>
 #include <gio/gio.h>
-#include <gio/gunixfdmessage.h>
 #include <gio/gunixsocketaddress.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <libdrm/drm_fourcc.h>
 #include <linux/uinput.h>
+#include <sys/stat.h>
 
 #include "config.h"
 #include "rf-common.h"
@@ -19,9 +20,33 @@
 #ifdef HAVE_LIBSYSTEMD
 #	include <systemd/sd-daemon.h>
 #endif
+#ifdef HAVE_LIBUDEV
+#	include <libudev.h>
+#endif
+#ifdef HAVE_LIBURING
+#	include <liburing.h>
+#endif
 
 #define WAKEUP_POINTER_MAX_EVENTS 3
 #define WAKEUP_KEYBOARD_MAX_EVENTS 2
+// Userspace needs some time to detect a new uinput device before wakeup.
+#define UINPUT_SETTLE_TIME G_USEC_PER_SEC
+// Userspace needs some time to process the press before release.
+#define WAKEUP_RELEASE_DELAY (G_USEC_PER_SEC / 10)
+// After wakeup, we wait for compositor to enable CRTC.
+#define WAKEUP_RETRY_INTERVAL (G_USEC_PER_SEC / 10)
+#define WAKEUP_RETRY_MAX 20
+// In seconds. Sockets are shared with other clients in the main loop, so a
+// Server that does not read or write for this long is disconnected instead of
+// blocking others.
+#define CLIENT_TIMEOUT 1
+// uinput device and DRM card are kept for this time after the last client
+// disconnected, so reconnecting is fast.
+#define IDLE_TIMEOUT (60 * G_USEC_PER_SEC)
+// We cannot get events when compositor enables CRTC or shows cursor, so we
+// check again after this interval.
+#define TOPOLOGY_RETRY_INTERVAL G_USEC_PER_SEC
+#define URING_ENTRIES 64
 
 // clang-format off
 #define ioctl_must(...)                                                         \
@@ -57,18 +82,155 @@
 	} G_STMT_END
 // clang-format on
 
+enum plane_prop {
+	PLANE_PROP_FB_ID,
+	PLANE_PROP_CRTC_ID,
+	PLANE_PROP_CRTC_X,
+	PLANE_PROP_CRTC_Y,
+	PLANE_PROP_CRTC_W,
+	PLANE_PROP_CRTC_H,
+	PLANE_PROP_SRC_X,
+	PLANE_PROP_SRC_Y,
+	PLANE_PROP_SRC_W,
+	PLANE_PROP_SRC_H,
+	PLANE_PROP_FB_DAMAGE_CLIPS,
+	N_PLANE_PROPS
+};
+
+static const char *plane_prop_names[N_PLANE_PROPS] = {
+	"FB_ID",
+	"CRTC_ID",
+	"CRTC_X",
+	"CRTC_Y",
+	"CRTC_W",
+	"CRTC_H",
+	"SRC_X",
+	"SRC_Y",
+	"SRC_W",
+	"SRC_H",
+	"FB_DAMAGE_CLIPS"
+};
+
+enum writeback_prop {
+	WRITEBACK_PROP_CRTC_ID,
+	WRITEBACK_PROP_FB_ID,
+	WRITEBACK_PROP_OUT_FENCE_PTR,
+	WRITEBACK_PROP_PIXEL_FORMATS,
+	N_WRITEBACK_PROPS
+};
+
+static const char *writeback_prop_names[N_WRITEBACK_PROPS] = {
+	"CRTC_ID",
+	"WRITEBACK_FB_ID",
+	"WRITEBACK_OUT_FENCE_PTR",
+	"WRITEBACK_PIXEL_FORMATS"
+};
+
+struct plane {
+	uint32_t id;
+	// Property IDs are stable for the lifetime of a plane, so we only
+	// resolve them once instead of enumerating all properties every frame.
+	uint32_t props[N_PLANE_PROPS];
+	// Values of the last snapshot, used to tell whether compositor
+	// committed something new.
+	uint64_t values[N_PLANE_PROPS];
+	// Whether the last snapshot differs from the one before it.
+	bool changed;
+};
+
+// Writeback connector writes the composed output of CRTC into a framebuffer we
+// own, so Server gets 1 buffer instead of planes.
+struct writeback {
+	// CRTC and size this is set up for, even if it failed.
+	uint32_t crtc_id;
+	uint32_t width;
+	uint32_t height;
+	uint32_t connector_id;
+	uint32_t props[N_WRITEBACK_PROPS];
+	uint32_t handle;
+	uint32_t fb_id;
+	// Attaching writeback connector to CRTC needs a modeset, but only once.
+	bool attached;
+	// Out fence of the running writeback job, main loop polls it and sends
+	// the frame when it signals.
+	int fence;
+};
+
+struct slot {
+	uint32_t fb_id;
+	// Framebuffer ID may be reused after compositor removes the framebuffer,
+	// so we also compare the inode of the exported dma-buf.
+	ino_t ino;
+	uint64_t used;
+};
+
+// Each ReFrame Server is a client and captures its own connector, but all
+// clients share the same DRM card and uinput device.
+struct client {
+	// Pointers may be freed before DRM events arrive, so we use IDs as event
+	// user data.
+	uint64_t id;
+	GSocketConnection *connection;
+	char *connector_name;
+	// Topology is cached and only queried again after hotplug or plane
+	// state mismatch, instead of every frame.
+	uint32_t crtc_id;
+	uint32_t crtc_width;
+	uint32_t crtc_height;
+	bool topology_dirty;
+	int64_t topology_retry_time;
+	int64_t cursor_retry_time;
+	struct plane primary_plane;
+	struct plane cursor_plane;
+	// Vblank sequence of the last snapshot. Compositors commit at most once
+	// per vblank, but we only see clips of the latest commit. Only if at
+	// most 1 vblank passed since the last snapshot and framebuffer changed
+	// from the one we saw, there is exactly 1 commit we have not seen, and
+	// its clips cover all changes.
+	uint64_t sequence;
+	bool damage_continuous;
+	struct writeback writeback;
+	struct slot slots[RF_MAX_SLOTS];
+	uint64_t n_frames;
+	// Server is waiting for a frame, but nothing changed since the last one.
+	bool frame_pending;
+	// Monotonic time to find topology again after wakeup, 0 means we are
+	// not waiting for wakeup.
+	int64_t wakeup_time;
+	int wakeup_retries;
+	char *wakeup_connector_name;
+	bool vblank;
+};
+
 struct this {
 	RfConfig *config;
-	GSocketConnection *connection;
+	GPtrArray *clients;
+	uint64_t next_client_id;
 	char *card_path;
-	char *connector_name;
 	int cfd;
-	uint32_t crtc_id;
-	uint32_t primary_id;
 	bool cursor;
-	uint32_t cursor_id;
 	int ufd;
+	int64_t uinput_time;
+	// Monotonic time to write wakeup press and release events, 0 means not
+	// scheduled. Main loop writes them instead of sleeping, so other
+	// clients are not blocked.
+	int64_t wakeup_press_time;
+	int64_t wakeup_release_time;
+	// Monotonic time when the last client disconnected.
+	int64_t idle_time;
+	// Topology of the last disconnected client.
+	struct client *idle_client;
+	// Main thread passes input channels to input thread via this pipe.
+	int input_pipe[2];
+	GThread *input_thread;
 	bool skip_auth;
+	bool push;
+	bool skip_unchanged;
+	bool writeback;
+#ifdef HAVE_LIBUDEV
+	struct udev *udev;
+	struct udev_monitor *monitor;
+#endif
 };
 
 static int auth_pid(struct this *this, pid_t pid, const char *target)
@@ -97,22 +259,24 @@ static int auth_pid(struct this *this, pid_t pid, const char *target)
 	return 0;
 }
 
-static ssize_t send_auth_msg(struct this *this, pid_t pid, bool ok)
+static ssize_t send_auth_msg(struct client *c, pid_t pid, bool ok)
 {
 	ssize_t ret = 0;
 	g_autoptr(GError) error = NULL;
-	GOutputStream *os =
-		g_io_stream_get_output_stream(G_IO_STREAM(this->connection));
 
-	ret = rf_send_header(this->connection, RF_MSG_TYPE_AUTH, 1, &error);
-	if (ret <= 0)
-		goto out;
 	struct rf_auth auth;
 	auth.pid = pid;
 	auth.ok = ok;
-	ret = g_output_stream_write(os, &auth, sizeof(auth), NULL, &error);
-
-out:
+	ret = rf_send_msg(
+		c->connection,
+		RF_MSG_TYPE_AUTH,
+		1,
+		&auth,
+		sizeof(auth),
+		NULL,
+		0,
+		&error
+	);
 	if (ret < 0)
 		g_warning(
 			"Auth: Failed to send auth message: %s.", error->message
@@ -124,19 +288,16 @@ out:
 	return ret;
 }
 
-static ssize_t on_auth_msg(struct this *this)
+static ssize_t
+on_auth_msg(struct this *this, struct client *c, size_t length)
 {
 	ssize_t ret = 0;
-	size_t length = 0;
 	g_autoptr(GError) error = NULL;
-	GInputStream *is =
-		g_io_stream_get_input_stream(G_IO_STREAM(this->connection));
 
-	ret = g_input_stream_read(is, &length, sizeof(length), NULL, &error);
-	if (ret <= 0 || length != 1)
+	if (length != 1)
 		goto out;
 	pid_t pid = -1;
-	ret = g_input_stream_read(is, &pid, sizeof(pid), NULL, &error);
+	ret = rf_receive_payload(c->connection, &pid, sizeof(pid), &error);
 	if (ret <= 0 || pid < 0)
 		goto out;
 
@@ -144,7 +305,7 @@ static ssize_t on_auth_msg(struct this *this)
 	bool ok = auth_pid(
 			  this, pid, BINDIR G_DIR_SEPARATOR_S "reframe-session"
 		  ) == 0;
-	return send_auth_msg(this, pid, ok);
+	return send_auth_msg(c, pid, ok);
 
 out:
 	if (ret < 0)
@@ -216,6 +377,287 @@ static uint32_t get_plane_id(int cfd, uint32_t crtc_id, uint32_t type)
 	return plane_id;
 }
 
+static void setup_plane(int cfd, struct plane *plane, uint32_t plane_id)
+{
+	plane->id = plane_id;
+	for (int i = 0; i < N_PLANE_PROPS; ++i) {
+		plane->props[i] = 0;
+		plane->values[i] = 0;
+	}
+	if (plane_id == 0)
+		return;
+	drmModeObjectProperties *props =
+		drmModeObjectGetProperties(cfd, plane_id, DRM_MODE_OBJECT_PLANE);
+	if (props == NULL) {
+		g_warning(
+			"DRM: Failed to get properties of plane ID %u.", plane_id
+		);
+		return;
+	}
+	for (size_t i = 0; i < props->count_props; ++i) {
+		drmModePropertyRes *prop =
+			drmModeGetProperty(cfd, props->props[i]);
+		if (prop == NULL)
+			continue;
+		for (int j = 0; j < N_PLANE_PROPS; ++j) {
+			if (g_strcmp0(prop->name, plane_prop_names[j]) == 0) {
+				plane->props[j] = prop->prop_id;
+				break;
+			}
+		}
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+}
+
+// Take a snapshot of all properties we need with only 1 ioctl. Missing
+// properties are 0.
+static int
+get_plane_props(int cfd, const struct plane *plane, uint64_t *values)
+{
+	for (int i = 0; i < N_PLANE_PROPS; ++i)
+		values[i] = 0;
+	drmModeObjectProperties *props =
+		drmModeObjectGetProperties(cfd, plane->id, DRM_MODE_OBJECT_PLANE);
+	if (props == NULL)
+		return -1;
+	for (size_t i = 0; i < props->count_props; ++i) {
+		for (int j = 0; j < N_PLANE_PROPS; ++j) {
+			if (plane->props[j] != 0 &&
+			    props->props[i] == plane->props[j]) {
+				values[j] = props->prop_values[i];
+				break;
+			}
+		}
+	}
+	drmModeFreeObjectProperties(props);
+	// `FB_ID` is only exposed to atomic clients.
+	if (plane->props[PLANE_PROP_FB_ID] == 0) {
+		drmModePlane *p = drmModeGetPlane(cfd, plane->id);
+		if (p == NULL)
+			return -1;
+		values[PLANE_PROP_FB_ID] = p->fb_id;
+		drmModeFreePlane(p);
+	}
+	return 0;
+}
+
+// Returns true if anything changed since the last snapshot.
+static bool update_plane(int cfd, struct plane *plane)
+{
+	uint64_t values[N_PLANE_PROPS];
+	// Failed snapshot is all 0, which means no framebuffer.
+	get_plane_props(cfd, plane, values);
+	const bool changed =
+		memcmp(values, plane->values, sizeof(values)) != 0;
+	memcpy(plane->values, values, sizeof(values));
+	plane->changed = changed;
+	return changed;
+}
+
+static inline char *get_connector_name(drmModeConnector *connector)
+{
+	return g_strdup_printf(
+		"%s-%d",
+		drmModeGetConnectorTypeName(connector->connector_type),
+		connector->connector_type_id
+	);
+}
+
+static drmModeCrtc *get_crtc(int cfd, drmModeConnector *connector)
+{
+	drmModeEncoder *encoder = NULL;
+	drmModeCrtc *crtc = NULL;
+	encoder = drmModeGetEncoder(cfd, connector->encoder_id);
+	if (encoder == NULL)
+		return NULL;
+	crtc = drmModeGetCrtc(cfd, encoder->crtc_id);
+	drmModeFreeEncoder(encoder);
+	return crtc;
+}
+
+// Compositors may blank screen by setting `ACTIVE` to 0, CRTC is still bound
+// to connector then, but it shows nothing until we wake it up.
+static bool is_crtc_active(int cfd, uint32_t crtc_id)
+{
+	bool active = false;
+	bool found = false;
+	drmModeObjectProperties *props =
+		drmModeObjectGetProperties(cfd, crtc_id, DRM_MODE_OBJECT_CRTC);
+	if (props != NULL) {
+		for (size_t i = 0; i < props->count_props && !found; ++i) {
+			drmModePropertyRes *prop =
+				drmModeGetProperty(cfd, props->props[i]);
+			if (prop == NULL)
+				continue;
+			if (g_strcmp0(prop->name, "ACTIVE") == 0) {
+				active = props->prop_values[i] != 0;
+				found = true;
+			}
+			drmModeFreeProperty(prop);
+		}
+		drmModeFreeObjectProperties(props);
+	}
+	// `ACTIVE` is only exposed to atomic clients.
+	if (!found) {
+		drmModeCrtc *crtc = drmModeGetCrtc(cfd, crtc_id);
+		if (crtc != NULL) {
+			active = crtc->mode_valid && crtc->buffer_id != 0;
+			drmModeFreeCrtc(crtc);
+		}
+	}
+	return active;
+}
+
+// Probing connector may take tens of milliseconds because kernel reads EDID
+// from monitors, so we only do it when opening card and use cached state later,
+// hotplug updates cached state anyway.
+static drmModeConnector *
+get_connector(int cfd, const char *connector_name, bool probe)
+{
+	drmModeConnector *connector = NULL;
+	drmModeRes *res = drmModeGetResources(cfd);
+	if (res == NULL) {
+		g_warning("DRM: Failed to get resources.");
+		return NULL;
+	}
+	if (connector_name != NULL)
+		g_debug("DRM: Finding connector for %s.", connector_name);
+	for (int i = 0; i < res->count_connectors; ++i) {
+		const uint32_t id = res->connectors[i];
+		if (probe)
+			connector = drmModeGetConnector(cfd, id);
+		else
+			connector = drmModeGetConnectorCurrent(cfd, id);
+		if (connector == NULL)
+			continue;
+		g_autofree char *full_name = get_connector_name(connector);
+		bool connected = connector->connection == DRM_MODE_CONNECTED;
+		drmModeCrtc *crtc = get_crtc(cfd, connector);
+		bool has_crtc = crtc != NULL;
+		if (crtc != NULL)
+			drmModeFreeCrtc(crtc);
+		bool matched = connector_name == NULL ||
+			       g_strcmp0(full_name, connector_name) == 0;
+		g_debug("DRM: Connector %s is %s and %s.",
+			full_name,
+			connected ? "connected" : "disconnected",
+			has_crtc ? "has active CRTC" : "has no active CRTC");
+		if (connected && has_crtc && matched)
+			break;
+		drmModeFreeConnector(connector);
+		connector = NULL;
+	}
+	drmModeFreeResources(res);
+	return connector;
+}
+
+// Find CRTC and primary plane for connector again, CRTC may be changed after
+// hotplug or mode setting.
+static void update_topology(struct this *this, struct client *c)
+{
+	uint32_t crtc_id = 0;
+	c->topology_dirty = false;
+	c->crtc_width = 0;
+	c->crtc_height = 0;
+
+	drmModeConnector *connector =
+		get_connector(this->cfd, c->connector_name, false);
+	if (connector != NULL) {
+		drmModeCrtc *crtc = get_crtc(this->cfd, connector);
+		drmModeFreeConnector(connector);
+		if (crtc != NULL) {
+			crtc_id = crtc->crtc_id;
+			c->crtc_width = crtc->width;
+			c->crtc_height = crtc->height;
+			drmModeFreeCrtc(crtc);
+		}
+	}
+	if (crtc_id == 0) {
+		c->topology_dirty = true;
+		c->topology_retry_time =
+			g_get_monotonic_time() + TOPOLOGY_RETRY_INTERVAL;
+	}
+	g_debug("DRM: Connector %s uses CRTC ID %u of width %u and height %u.",
+		c->connector_name,
+		crtc_id,
+		c->crtc_width,
+		c->crtc_height);
+
+	if (crtc_id == c->crtc_id)
+		return;
+	c->crtc_id = crtc_id;
+	c->sequence = 0;
+	uint32_t primary_id = 0;
+	if (crtc_id != 0)
+		primary_id = get_plane_id(
+			this->cfd, crtc_id, DRM_PLANE_TYPE_PRIMARY
+		);
+	setup_plane(this->cfd, &c->primary_plane, primary_id);
+	setup_plane(this->cfd, &c->cursor_plane, 0);
+	c->cursor_retry_time = 0;
+}
+
+static bool update_planes(struct this *this, struct client *c)
+{
+	const int64_t now = g_get_monotonic_time();
+	const uint64_t *values = c->primary_plane.values;
+	const uint64_t crtc_w = values[PLANE_PROP_CRTC_W];
+	const uint64_t crtc_h = values[PLANE_PROP_CRTC_H];
+	const uint32_t primary_id = c->primary_plane.id;
+	const uint64_t fb_id = values[PLANE_PROP_FB_ID];
+
+	bool changed = update_plane(this->cfd, &c->primary_plane);
+	// Plane state does not match cached topology, maybe mode changed or
+	// CRTC is reassigned.
+	if (changed && (values[PLANE_PROP_FB_ID] == 0 ||
+			values[PLANE_PROP_CRTC_ID] != c->crtc_id ||
+			values[PLANE_PROP_CRTC_W] != crtc_w ||
+			values[PLANE_PROP_CRTC_H] != crtc_h)) {
+		c->topology_dirty = true;
+		c->topology_retry_time = 0;
+	}
+	if (c->topology_dirty && now >= c->topology_retry_time) {
+		update_topology(this, c);
+		if (c->primary_plane.id != primary_id)
+			changed = update_plane(this->cfd, &c->primary_plane) ||
+				  changed;
+	}
+
+	// Cursor plane is not bound to CRTC if it is hidden.
+	if (this->cursor && c->crtc_id != 0 && c->cursor_plane.id == 0 &&
+	    now >= c->cursor_retry_time) {
+		const uint32_t cursor_id = get_plane_id(
+			this->cfd, c->crtc_id, DRM_PLANE_TYPE_CURSOR
+		);
+		setup_plane(this->cfd, &c->cursor_plane, cursor_id);
+		c->cursor_retry_time = now + TOPOLOGY_RETRY_INTERVAL;
+	}
+	if (c->cursor_plane.id != 0)
+		changed = update_plane(this->cfd, &c->cursor_plane) || changed;
+
+	uint64_t sequence = 0;
+	uint64_t ns = 0;
+	if (c->crtc_id == 0 ||
+	    drmCrtcGetSequence(this->cfd, c->crtc_id, &sequence, &ns) != 0)
+		sequence = 0;
+	c->damage_continuous = c->sequence != 0 && sequence != 0 &&
+			       sequence - c->sequence <= 1 &&
+			       c->primary_plane.id == primary_id &&
+			       fb_id != 0 && values[PLANE_PROP_FB_ID] != fb_id;
+	c->sequence = sequence;
+	return changed;
+}
+
+// `drmModeGetFB2()` and `drmModeGetFB()` create new GEM handles every time,
+// they must be closed after exporting or they leak until we close the card.
+static void close_handle(int cfd, uint32_t handle)
+{
+	struct drm_gem_close arg = { 0 };
+	arg.handle = handle;
+	drmIoctl(cfd, DRM_IOCTL_GEM_CLOSE, &arg);
+}
+
 static int export_fb2(int cfd, struct rf_buffer *b, uint32_t fb_id)
 {
 	drmModeFB2 *fb = drmModeGetFB2(cfd, fb_id);
@@ -230,6 +672,17 @@ static int export_fb2(int cfd, struct rf_buffer *b, uint32_t fb_id)
 			break;
 		++b->md.length;
 	}
+	for (int i = 0; i < RF_MAX_FDS; ++i) {
+		if (fb->handles[i] == 0)
+			break;
+		// Planes may share the same handle.
+		bool closed = false;
+		for (int j = 0; j < i; ++j)
+			if (fb->handles[j] == fb->handles[i])
+				closed = true;
+		if (!closed)
+			close_handle(cfd, fb->handles[i]);
+	}
 	b->md.fb_width = fb->width;
 	b->md.fb_height = fb->height;
 	b->md.fourcc = fb->pixel_format;
@@ -250,11 +703,16 @@ static int export_fb(int cfd, struct rf_buffer *b, uint32_t fb_id)
 	if (fb == NULL)
 		return 0;
 	g_debug("Frame: Got FB framebuffer ID %u.", fb->fb_id);
-	if (fb->handle == 0)
+	if (fb->handle == 0) {
+		drmModeFreeFB(fb);
 		return 0;
+	}
 	drmPrimeHandleToFD(cfd, fb->handle, DRM_CLOEXEC, &b->fds[0]);
-	if (b->fds[0] < 0)
+	close_handle(cfd, fb->handle);
+	if (b->fds[0] < 0) {
+		drmModeFreeFB(fb);
 		return 0;
+	}
 	b->md.length = 1;
 	b->md.fb_width = fb->width;
 	b->md.fb_height = fb->height;
@@ -266,33 +724,33 @@ static int export_fb(int cfd, struct rf_buffer *b, uint32_t fb_id)
 	return b->md.length;
 }
 
-static int
-make_buffer(int cfd, struct rf_buffer *b, uint32_t plane_id, uint32_t type)
+// Call `update_planes()` before this to get the newest framebuffer.
+static int make_buffer(
+	int cfd,
+	struct rf_buffer *b,
+	const struct plane *plane,
+	uint32_t type
+)
 {
-	drmModePlane *plane = drmModeGetPlane(cfd, plane_id);
-	if (plane == NULL)
-		return 0;
-	const uint32_t fb_id = plane->fb_id;
-	drmModeFreePlane(plane);
+	const uint64_t *values = plane->values;
+	const uint32_t fb_id = (uint32_t)values[PLANE_PROP_FB_ID];
 	if (fb_id == 0)
 		return 0;
 	g_debug("Frame: Got %s plane framebuffer ID %u.",
 		rf_plane_type(type),
 		fb_id);
 	b->md.type = type;
-	b->md.crtc_x = (int32_t)get_plane_prop(cfd, plane_id, "CRTC_X", 0);
-	b->md.crtc_y = (int32_t)get_plane_prop(cfd, plane_id, "CRTC_Y", 0);
-	b->md.crtc_w = (uint32_t)get_plane_prop(cfd, plane_id, "CRTC_W", 0);
-	b->md.crtc_h = (uint32_t)get_plane_prop(cfd, plane_id, "CRTC_H", 0);
+	b->md.fb_id = fb_id;
+	b->md.unchanged = !plane->changed;
+	b->md.crtc_x = (int32_t)values[PLANE_PROP_CRTC_X];
+	b->md.crtc_y = (int32_t)values[PLANE_PROP_CRTC_Y];
+	b->md.crtc_w = (uint32_t)values[PLANE_PROP_CRTC_W];
+	b->md.crtc_h = (uint32_t)values[PLANE_PROP_CRTC_H];
 	// These are in 16.16 fixed point, we only need integer.
-	b->md.src_x =
-		(uint32_t)(get_plane_prop(cfd, plane_id, "SRC_X", 0) >> 16);
-	b->md.src_y =
-		(uint32_t)(get_plane_prop(cfd, plane_id, "SRC_Y", 0) >> 16);
-	b->md.src_w =
-		(uint32_t)(get_plane_prop(cfd, plane_id, "SRC_W", 0) >> 16);
-	b->md.src_h =
-		(uint32_t)(get_plane_prop(cfd, plane_id, "SRC_H", 0) >> 16);
+	b->md.src_x = (uint32_t)(values[PLANE_PROP_SRC_X] >> 16);
+	b->md.src_y = (uint32_t)(values[PLANE_PROP_SRC_Y] >> 16);
+	b->md.src_w = (uint32_t)(values[PLANE_PROP_SRC_W] >> 16);
+	b->md.src_h = (uint32_t)(values[PLANE_PROP_SRC_H] >> 16);
 
 	int ret = 0;
 	// GUnixFDList refuses to send invalid fds like -1, so we need
@@ -314,144 +772,676 @@ make_buffer(int cfd, struct rf_buffer *b, uint32_t plane_id, uint32_t type)
 	return ret;
 }
 
-static ssize_t
-send_buffer(GSocketConnection *connection, struct rf_buffer *b, GError **error)
+// Plane may be scaled, round outwards. Returns false if nothing is on monitor.
+static bool map_clip(
+	const struct rf_buffer *b,
+	const struct drm_mode_rect *clip,
+	struct rf_rect *rect
+)
 {
-	ssize_t ret = 0;
-	GOutputVector iov = { &b->md, sizeof(b->md) };
-	GUnixFDList *fds = g_unix_fd_list_new();
-	// This won't take the ownership so we need to close fds.
-	//
-	// See <https://docs.gtk.org/gio/method.UnixFDList.append.html>.
-	for (unsigned int i = 0; i < b->md.length; ++i)
-		g_unix_fd_list_append(fds, b->fds[i], NULL);
-	// This won't take the ownership so we need to free GUnixFDList.
-	GSocketControlMessage *msg = g_unix_fd_message_new_with_fd_list(fds);
-	GSocket *socket = g_socket_connection_get_socket(connection);
-	ret = g_socket_send_message(
-		socket, NULL, &iov, 1, &msg, 1, G_SOCKET_MSG_NONE, NULL, error
-	);
-	g_clear_object(&fds);
-	g_clear_object(&msg);
-	return ret;
+	const int64_t src_x = b->md.src_x;
+	const int64_t src_y = b->md.src_y;
+	int64_t x1 = MAX(clip->x1, src_x);
+	int64_t y1 = MAX(clip->y1, src_y);
+	int64_t x2 = MIN(clip->x2, src_x + b->md.src_w);
+	int64_t y2 = MIN(clip->y2, src_y + b->md.src_h);
+	if (x1 >= x2 || y1 >= y2)
+		return false;
+
+	x1 = b->md.crtc_x + (x1 - b->md.src_x) * b->md.crtc_w / b->md.src_w;
+	y1 = b->md.crtc_y + (y1 - b->md.src_y) * b->md.crtc_h / b->md.src_h;
+	x2 = b->md.crtc_x + ((x2 - b->md.src_x) * b->md.crtc_w +
+			     b->md.src_w - 1) / b->md.src_w;
+	y2 = b->md.crtc_y + ((y2 - b->md.src_y) * b->md.crtc_h +
+			     b->md.src_h - 1) / b->md.src_h;
+	x1 = MAX(x1, 0);
+	y1 = MAX(y1, 0);
+	x2 = MIN(x2, b->md.crtc_width);
+	y2 = MIN(y2, b->md.crtc_height);
+	if (x1 >= x2 || y1 >= y2)
+		return false;
+	rect->x = x1;
+	rect->y = y1;
+	rect->w = x2 - x1;
+	rect->h = y2 - y1;
+	return true;
 }
 
-static ssize_t
-send_frame_msg(struct this *this, size_t length, struct rf_buffer *bufs)
+// Compositor tells what it changed with `FB_DAMAGE_CLIPS` in framebuffer
+// coordinates, we send them on monitor so Server could skip damage region
+// detection.
+static void get_damage(int cfd, const struct client *c, struct rf_buffer *b)
 {
-	ssize_t ret = 0;
-	g_autoptr(GError) error = NULL;
+	const struct plane *plane = &c->primary_plane;
+	const uint64_t blob_id = plane->values[PLANE_PROP_FB_DAMAGE_CLIPS];
 
-	ret = rf_send_header(this->connection, RF_MSG_TYPE_FRAME, length, &error);
-	if (ret <= 0)
-		goto out;
-	for (size_t i = 0; i < length; ++i) {
-		ret = send_buffer(this->connection, &bufs[i], &error);
-		if (ret <= 0)
-			break;
+	b->md.has_damage = false;
+	rf_region_clear(&b->md.damage);
+
+	if (b->md.unchanged) {
+		b->md.has_damage = true;
+		return;
 	}
+	// No clips means the whole plane is damaged.
+	if (!c->damage_continuous || blob_id == 0 || b->md.src_w == 0 ||
+	    b->md.src_h == 0)
+		return;
+
+	drmModePropertyBlobRes *blob =
+		drmModeGetPropertyBlob(cfd, (uint32_t)blob_id);
+	if (blob == NULL)
+		return;
+	const struct drm_mode_rect *clips = blob->data;
+	const size_t n = blob->length / sizeof(*clips);
+	for (size_t i = 0; i < n; ++i) {
+		struct rf_rect rect;
+		if (map_clip(b, &clips[i], &rect))
+			rf_region_add(&b->md.damage, &rect);
+	}
+	drmModeFreePropertyBlob(blob);
+	if (n == 0)
+		return;
 
-out:
-	if (ret < 0)
-		g_warning("Frame: Failed to send frame: %s.", error->message);
-	return ret;
+	b->md.has_damage = true;
+	rf_region_debug(&b->md.damage, "damage clips");
 }
 
-static ssize_t on_frame_msg(struct this *this)
+// Atomic commits are only allowed for DRM master. We only hold it during the
+// commit, so compositor could still start after ReFrame.
+static int
+commit_as_master(int cfd, drmModeAtomicReq *req, uint32_t flags, bool *master)
 {
-	g_debug("Frame: Received frame message.");
-
-	struct rf_buffer bufs[RF_MAX_BUFS];
-	ssize_t ret = 0;
-	size_t length = 0;
-	g_autoptr(GError) error = NULL;
-	GInputStream *is =
-		g_io_stream_get_input_stream(G_IO_STREAM(this->connection));
+	*master = drmSetMaster(cfd) == 0;
+	if (!*master)
+		return -1;
+	const int ret = drmModeAtomicCommit(cfd, req, flags, NULL);
+	const int err = errno;
+	drmDropMaster(cfd);
+	errno = err;
+	return ret;
+}
 
-	ret = g_input_stream_read(is, &length, sizeof(length), NULL, &error);
-	if (ret <= 0) {
-		if (ret < 0)
-			g_warning(
-				"Frame: Failed to receive frame message: %s.",
-				error->message
-			);
-		return ret;
+static void clean_writeback(struct this *this, struct writeback *wb)
+{
+	if (wb->fence >= 0) {
+		close(wb->fence);
+		wb->fence = -1;
 	}
-
-	// CRTC size.
-	drmModeCrtc *crtc = drmModeGetCrtc(this->cfd, this->crtc_id);
-	// Empty CRTC, maybe locked screen and turned monitor off, skip it.
-	if (crtc == NULL) {
-		g_debug("Frame: Got empty CRTC.");
-		ret = send_frame_msg(this, 0, NULL);
-		return ret;
+	// Compositor cannot disable CRTC if writeback connector is attached to
+	// it, but we need DRM master to detach it.
+	if (wb->attached) {
+		drmModeAtomicReq *req = drmModeAtomicAlloc();
+		if (req != NULL) {
+			bool master = false;
+			drmModeAtomicAddProperty(
+				req,
+				wb->connector_id,
+				wb->props[WRITEBACK_PROP_CRTC_ID],
+				0
+			);
+			commit_as_master(
+				this->cfd,
+				req,
+				DRM_MODE_ATOMIC_ALLOW_MODESET,
+				&master
+			);
+			drmModeAtomicFree(req);
+		}
 	}
-	for (size_t i = 0; i < RF_MAX_BUFS; ++i) {
-		bufs[i].md.crtc_width = crtc->width;
-		bufs[i].md.crtc_height = crtc->height;
+	if (wb->fb_id != 0) {
+		drmModeRmFB(this->cfd, wb->fb_id);
+		wb->fb_id = 0;
 	}
-	drmModeFreeCrtc(crtc);
-
-	// Primary plane.
-	length = 0;
-	ret = make_buffer(
-		this->cfd,
-		&bufs[length++],
-		this->primary_id,
-		DRM_PLANE_TYPE_PRIMARY
-	);
-	// Empty buffer, maybe locked screen and turned monitor off, skip it.
-	if (ret <= 0) {
-		g_debug("Frame: Got empty buffer for primary plane.");
-		ret = send_frame_msg(this, 0, NULL);
-		return ret;
+	if (wb->handle != 0) {
+		drmModeDestroyDumbBuffer(this->cfd, wb->handle);
+		wb->handle = 0;
 	}
+	wb->connector_id = 0;
+	wb->attached = false;
+}
 
-	// Cursor plane.
-	if (this->cursor && this->cursor_id == 0)
-		this->cursor_id = get_plane_id(
-			this->cfd, this->crtc_id, DRM_PLANE_TYPE_CURSOR
-		);
-	if (this->cursor_id != 0) {
-		ret = make_buffer(
-			this->cfd,
-			&bufs[length++],
-			this->cursor_id,
-			DRM_PLANE_TYPE_CURSOR
-		);
-		// It is OK to ignore cursor plane if failed.
-		if (ret <= 0)
-			--length;
+static uint32_t get_writeback_connector_id(int cfd, uint32_t crtc_id)
+{
+	uint32_t connector_id = 0;
+	drmModeRes *res = drmModeGetResources(cfd);
+	if (res == NULL)
+		return 0;
+	int crtc_index = -1;
+	for (int i = 0; i < res->count_crtcs; ++i)
+		if (res->crtcs[i] == crtc_id)
+			crtc_index = i;
+	for (int i = 0; crtc_index >= 0 && i < res->count_connectors; ++i) {
+		drmModeConnector *connector =
+			drmModeGetConnectorCurrent(cfd, res->connectors[i]);
+		if (connector == NULL)
+			continue;
+		if (connector->connector_type != DRM_MODE_CONNECTOR_WRITEBACK) {
+			drmModeFreeConnector(connector);
+			continue;
+		}
+		for (int j = 0; j < connector->count_encoders; ++j) {
+			drmModeEncoder *encoder =
+				drmModeGetEncoder(cfd, connector->encoders[j]);
+			if (encoder == NULL)
+				continue;
+			if (encoder->possible_crtcs & (1 << crtc_index))
+				connector_id = connector->connector_id;
+			drmModeFreeEncoder(encoder);
+		}
+		drmModeFreeConnector(connector);
+		if (connector_id != 0)
+			break;
 	}
+	drmModeFreeResources(res);
+	return connector_id;
+}
 
-	ret = send_frame_msg(this, length, bufs);
-
-	for (size_t i = 0; i < length; ++i)
-		for (unsigned int j = 0; j < bufs[i].md.length; ++j)
-			close(bufs[i].fds[j]);
-	return ret;
+static bool has_writeback_format(int cfd, uint64_t blob_id, uint32_t fourcc)
+{
+	bool found = false;
+	drmModePropertyBlobRes *blob =
+		drmModeGetPropertyBlob(cfd, (uint32_t)blob_id);
+	if (blob == NULL)
+		return false;
+	const uint32_t *formats = blob->data;
+	for (size_t i = 0; i < blob->length / sizeof(*formats); ++i)
+		if (formats[i] == fourcc)
+			found = true;
+	drmModeFreePropertyBlob(blob);
+	return found;
 }
 
-static ssize_t on_input_msg(struct this *this)
+static void setup_writeback(struct this *this, struct client *c)
 {
-	g_debug("Input: Received input message.");
+	struct writeback *wb = &c->writeback;
+	clean_writeback(this, wb);
+	wb->crtc_id = c->crtc_id;
+	wb->width = c->crtc_width;
+	wb->height = c->crtc_height;
+	if (c->crtc_id == 0 || c->crtc_width == 0 || c->crtc_height == 0)
+		return;
+
+	const uint32_t connector_id =
+		get_writeback_connector_id(this->cfd, c->crtc_id);
+	if (connector_id == 0) {
+		g_message("DRM: No writeback connector for CRTC ID %u.",
+			  c->crtc_id);
+		return;
+	}
 
-	g_autofree struct input_event *ies = NULL;
+	uint64_t formats = 0;
+	for (int i = 0; i < N_WRITEBACK_PROPS; ++i)
+		wb->props[i] = 0;
+	drmModeObjectProperties *props = drmModeObjectGetProperties(
+		this->cfd, connector_id, DRM_MODE_OBJECT_CONNECTOR
+	);
+	if (props == NULL)
+		return;
+	for (size_t i = 0; i < props->count_props; ++i) {
+		drmModePropertyRes *prop =
+			drmModeGetProperty(this->cfd, props->props[i]);
+		if (prop == NULL)
+			continue;
+		for (int j = 0; j < N_WRITEBACK_PROPS; ++j) {
+			if (g_strcmp0(prop->name, writeback_prop_names[j]) ==
+			    0) {
+				wb->props[j] = prop->prop_id;
+				if (j == WRITEBACK_PROP_PIXEL_FORMATS)
+					formats = props->prop_values[i];
+				break;
+			}
+		}
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+	for (int i = 0; i < N_WRITEBACK_PROPS; ++i) {
+		if (wb->props[i] == 0) {
+			g_warning(
+				"DRM: Failed to get writeback connector property %s.",
+				writeback_prop_names[i]
+			);
+			return;
+		}
+	}
+	if (!has_writeback_format(this->cfd, formats, DRM_FORMAT_XRGB8888)) {
+		g_warning(
+			"DRM: Writeback connector does not support XRGB8888."
+		);
+		return;
+	}
+
+	uint32_t pitch = 0;
+	uint64_t size = 0;
+	if (drmModeCreateDumbBuffer(
+		    this->cfd,
+		    wb->width,
+		    wb->height,
+		    32,
+		    0,
+		    &wb->handle,
+		    &pitch,
+		    &size
+	    ) != 0) {
+		g_warning("DRM: Failed to create writeback buffer: %s.",
+			  strerror(errno));
+		wb->handle = 0;
+		return;
+	}
+	const uint32_t handles[RF_MAX_FDS] = { wb->handle, 0, 0, 0 };
+	const uint32_t pitches[RF_MAX_FDS] = { pitch, 0, 0, 0 };
+	const uint32_t offsets[RF_MAX_FDS] = { 0, 0, 0, 0 };
+	if (drmModeAddFB2(
+		    this->cfd,
+		    wb->width,
+		    wb->height,
+		    DRM_FORMAT_XRGB8888,
+		    handles,
+		    pitches,
+		    offsets,
+		    &wb->fb_id,
+		    0
+	    ) != 0) {
+		g_warning("DRM: Failed to add writeback framebuffer: %s.",
+			  strerror(errno));
+		wb->fb_id = 0;
+		clean_writeback(this, wb);
+		return;
+	}
+	wb->connector_id = connector_id;
+	g_message("DRM: Capturing CRTC ID %u via writeback connector ID %u.",
+		  c->crtc_id,
+		  connector_id);
+}
+
+// The job runs asynchronously, main loop polls the out fence and exports the
+// buffer after it signals, otherwise Server reads a partial frame.
+static int start_writeback(struct this *this, struct client *c)
+{
+	struct writeback *wb = &c->writeback;
+	int ret = 0;
+	int fence = -1;
+	bool master = false;
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	if (req == NULL)
+		return -1;
+	drmModeAtomicAddProperty(
+		req,
+		wb->connector_id,
+		wb->props[WRITEBACK_PROP_CRTC_ID],
+		c->crtc_id
+	);
+	drmModeAtomicAddProperty(
+		req,
+		wb->connector_id,
+		wb->props[WRITEBACK_PROP_FB_ID],
+		wb->fb_id
+	);
+	drmModeAtomicAddProperty(
+		req,
+		wb->connector_id,
+		wb->props[WRITEBACK_PROP_OUT_FENCE_PTR],
+		(uint64_t)(uintptr_t)&fence
+	);
+
+	ret = commit_as_master(
+		this->cfd,
+		req,
+		wb->attached ? 0 : DRM_MODE_ATOMIC_ALLOW_MODESET,
+		&master
+	);
+	drmModeAtomicFree(req);
+	// Another process holds DRM master, fail now instead of trying on every
+	// frame until topology changes.
+	if (!master) {
+		g_warning(
+			"DRM: Failed to become DRM master for writeback, fallback to planes: %s.",
+			strerror(errno)
+		);
+		clean_writeback(this, wb);
+		return -1;
+	}
+	if (ret != 0) {
+		g_warning("DRM: Failed to commit writeback job: %s.",
+			  strerror(errno));
+		return -1;
+	}
+	wb->attached = true;
+	if (fence < 0) {
+		g_warning("DRM: Failed to get writeback out fence.");
+		return -1;
+	}
+	wb->fence = fence;
+	return 0;
+}
+
+static int
+export_writeback(struct this *this, struct client *c, struct rf_buffer *b)
+{
+	struct writeback *wb = &c->writeback;
+	int ret = 0;
+
+	b->md.type = DRM_PLANE_TYPE_PRIMARY;
+	b->md.fb_id = wb->fb_id;
+	b->md.unchanged = false;
+	// Composed output contains all planes, primary plane damage is not
+	// enough.
+	b->md.has_damage = false;
+	rf_region_clear(&b->md.damage);
+	b->md.crtc_x = 0;
+	b->md.crtc_y = 0;
+	b->md.crtc_w = wb->width;
+	b->md.crtc_h = wb->height;
+	b->md.src_x = 0;
+	b->md.src_y = 0;
+	b->md.src_w = wb->width;
+	b->md.src_h = wb->height;
+	b->md.length = 0;
+	for (int i = 0; i < RF_MAX_FDS; ++i) {
+		b->fds[i] = -1;
+		b->md.offsets[i] = 0;
+		b->md.pitches[i] = 0;
+	}
+	ret = export_fb2(this->cfd, b, wb->fb_id);
+	if (ret <= 0)
+		ret = export_fb(this->cfd, b, wb->fb_id);
+	if (ret > 0)
+		rf_buffer_debug(b);
+	return ret;
+}
+
+static void reset_slots(struct client *c)
+{
+	for (int i = 0; i < RF_MAX_SLOTS; ++i) {
+		c->slots[i].fb_id = 0;
+		c->slots[i].ino = 0;
+		c->slots[i].used = 0;
+	}
+	c->n_frames = 0;
+}
+
+// Server already has fds if framebuffer is in a slot, otherwise we register it
+// into the least recently used slot and send fds.
+static void register_buffer(struct client *c, struct rf_buffer *b)
+{
+	ino_t ino = 0;
+	struct stat st;
+	if (fstat(b->fds[0], &st) == 0)
+		ino = st.st_ino;
+
+	b->md.cached = false;
+	int lru = 0;
+	for (int i = 0; i < RF_MAX_SLOTS; ++i) {
+		struct slot *s = &c->slots[i];
+		if (ino != 0 && s->fb_id == b->md.fb_id && s->ino == ino) {
+			s->used = c->n_frames;
+			b->md.slot = i;
+			b->md.cached = true;
+			for (unsigned int j = 0; j < b->md.length; ++j) {
+				close(b->fds[j]);
+				b->fds[j] = -1;
+			}
+			return;
+		}
+		if (s->used < c->slots[lru].used)
+			lru = i;
+	}
+
+	g_debug("Frame: Registering framebuffer ID %u into slot %d.",
+		b->md.fb_id,
+		lru);
+	c->slots[lru].fb_id = b->md.fb_id;
+	c->slots[lru].ino = ino;
+	c->slots[lru].used = c->n_frames;
+	b->md.slot = lru;
+}
+
+// All metadata are sent as 1 payload, and fds of uncached buffers are sent in
+// order with it, so Server gets the whole frame with 1 `recvmsg()`.
+static ssize_t
+send_frame_msg(struct client *c, size_t length, struct rf_buffer *bufs)
+{
+	ssize_t ret = 0;
+	g_autoptr(GError) error = NULL;
+	struct rf_buffer_metadata mds[RF_MAX_BUFS];
+	int fds[RF_MAX_BUFS * RF_MAX_FDS];
+	int n_fds = 0;
+
+	// Metadata is sent as raw bytes, don't leak stack into padding.
+	memset(mds, 0, sizeof(mds));
+	for (size_t i = 0; i < length; ++i) {
+		memcpy(&mds[i], &bufs[i].md, sizeof(mds[i]));
+		if (bufs[i].md.cached)
+			continue;
+		for (unsigned int j = 0; j < bufs[i].md.length; ++j) {
+			fds[n_fds++] = bufs[i].fds[j];
+			// Ownership is passed to the message.
+			bufs[i].fds[j] = -1;
+		}
+	}
+	ret = rf_send_msg(
+		c->connection,
+		RF_MSG_TYPE_FRAME,
+		length,
+		mds,
+		length * sizeof(*mds),
+		fds,
+		n_fds,
+		&error
+	);
+	if (ret < 0)
+		g_warning("Frame: Failed to send frame: %s.", error->message);
+	return ret;
+}
+
+static void init_buffers(struct client *c, struct rf_buffer *bufs)
+{
+	// Unused fields are sent to Server, they must not be garbage.
+	memset(bufs, 0, RF_MAX_BUFS * sizeof(*bufs));
+	// Cached CRTC size.
+	for (size_t i = 0; i < RF_MAX_BUFS; ++i) {
+		bufs[i].md.crtc_width = c->crtc_width;
+		bufs[i].md.crtc_height = c->crtc_height;
+	}
+}
+
+static ssize_t
+send_planes(struct this *this, struct client *c, struct rf_buffer *bufs)
+{
 	ssize_t ret = 0;
 	size_t length = 0;
+
+	// Primary plane.
+	ret = make_buffer(
+		this->cfd,
+		&bufs[length++],
+		&c->primary_plane,
+		DRM_PLANE_TYPE_PRIMARY
+	);
+	// Empty buffer, maybe locked screen and turned monitor off, skip it.
+	if (ret <= 0) {
+		g_debug("Frame: Got empty buffer for primary plane.");
+		ret = send_frame_msg(c, 0, NULL);
+		return ret;
+	}
+	get_damage(this->cfd, c, &bufs[0]);
+
+	// Cursor plane.
+	if (c->cursor_plane.id != 0) {
+		ret = make_buffer(
+			this->cfd,
+			&bufs[length++],
+			&c->cursor_plane,
+			DRM_PLANE_TYPE_CURSOR
+		);
+		// It is OK to ignore cursor plane if failed.
+		if (ret <= 0)
+			--length;
+	}
+	// Damage clips are only for primary plane.
+	for (size_t i = 1; i < length; ++i) {
+		bufs[i].md.has_damage = false;
+		rf_region_clear(&bufs[i].md.damage);
+	}
+
+	for (size_t i = 0; i < length; ++i)
+		register_buffer(c, &bufs[i]);
+
+	return send_frame_msg(c, length, bufs);
+}
+
+static ssize_t send_frame(struct this *this, struct client *c)
+{
+	struct rf_buffer bufs[RF_MAX_BUFS];
+
+	c->frame_pending = false;
+	++c->n_frames;
+
+	// Empty CRTC, maybe locked screen and turned monitor off, skip it.
+	if (c->crtc_id == 0) {
+		g_debug("Frame: Got empty CRTC.");
+		return send_frame_msg(c, 0, NULL);
+	}
+
+	if (this->writeback) {
+		struct writeback *wb = &c->writeback;
+		if (wb->crtc_id != c->crtc_id || wb->width != c->crtc_width ||
+		    wb->height != c->crtc_height)
+			setup_writeback(this, c);
+		// Frame is sent by `on_writeback_fence()` when the job is done.
+		if (wb->fence >= 0 ||
+		    (wb->fb_id != 0 && start_writeback(this, c) == 0))
+			return 1;
+	}
+
+	init_buffers(c, bufs);
+	return send_planes(this, c, bufs);
+}
+
+static ssize_t on_writeback_fence(struct this *this, struct client *c)
+{
+	struct writeback *wb = &c->writeback;
+	struct rf_buffer bufs[RF_MAX_BUFS];
+
+	close(wb->fence);
+	wb->fence = -1;
+	init_buffers(c, bufs);
+	if (export_writeback(this, c, &bufs[0]) > 0) {
+		register_buffer(c, &bufs[0]);
+		return send_frame_msg(c, 1, bufs);
+	}
+	init_buffers(c, bufs);
+	return send_planes(this, c, bufs);
+}
+
+static ssize_t send_frame_unchanged_msg(struct client *c)
+{
+	ssize_t ret = 0;
+	g_autoptr(GError) error = NULL;
+
+	c->frame_pending = false;
+
+	ret = rf_send_msg(
+		c->connection,
+		RF_MSG_TYPE_FRAME_UNCHANGED,
+		0,
+		NULL,
+		0,
+		NULL,
+		0,
+		&error
+	);
+	if (ret < 0)
+		g_warning(
+			"Frame: Failed to send frame unchanged message: %s.",
+			error->message
+		);
+	else if (ret > 0)
+		g_debug("Frame: Sent frame unchanged message.");
+	return ret;
+}
+
+// Wait for the next vblank and check again.
+static ssize_t wait_frame(struct this *this, struct client *c)
+{
+	if (drmCrtcQueueSequence(
+		    this->cfd,
+		    c->crtc_id,
+		    DRM_CRTC_SEQUENCE_RELATIVE |
+			    DRM_CRTC_SEQUENCE_NEXT_ON_MISS,
+		    1,
+		    NULL,
+		    c->id
+	    ) != 0) {
+		// Vblank is not available if CRTC is off, fallback to let
+		// server poll again.
+		g_debug("Frame: Failed to queue CRTC sequence: %s.",
+			strerror(errno));
+		return send_frame_unchanged_msg(c);
+	}
+	c->frame_pending = true;
+	return 1;
+}
+
+// Only send frame when compositor committed new plane states, so server could
+// skip converting the same framebuffers.
+static ssize_t check_frame(struct this *this, struct client *c)
+{
+	if (update_planes(this, c))
+		return send_frame(this, c);
+	if (this->push)
+		return wait_frame(this, c);
+	return send_frame_unchanged_msg(c);
+}
+
+static ssize_t
+on_frame_msg(struct this *this, struct client *c, size_t length)
+{
+	g_debug("Frame: Received frame message.");
+
+	// Server did not select connector.
+	if (c->connector_name == NULL)
+		return send_frame_msg(c, 0, NULL);
+
+	// Non-0 length means server wants a whole frame anyway.
+	if (this->skip_unchanged && length == 0)
+		return check_frame(this, c);
+	update_planes(this, c);
+	// Compositor may draw into the same framebuffer, so plane states
+	// tell nothing here.
+	c->primary_plane.changed = true;
+	c->cursor_plane.changed = true;
+	c->damage_continuous = false;
+	return send_frame(this, c);
+}
+
+// This may run in input thread, which passes `pending` to collect events and
+// write them to uinput in one batch. Otherwise events are written immediately.
+static ssize_t on_input_msg(
+	struct this *this,
+	GSocketConnection *connection,
+	size_t length,
+	GByteArray *pending
+)
+{
+	g_debug("Input: Received input message.");
+
+	g_autofree struct input_event *ies = NULL;
+	ssize_t ret = 0;
 	g_autoptr(GError) error = NULL;
-	GInputStream *is =
-		g_io_stream_get_input_stream(G_IO_STREAM(this->connection));
 
-	ret = g_input_stream_read(is, &length, sizeof(length), NULL, &error);
-	if (ret <= 0)
-		goto out;
 	ies = g_malloc_n(length, sizeof(*ies));
-	ret = g_input_stream_read(is, ies, length * sizeof(*ies), NULL, &error);
+	ret = rf_receive_payload(
+		connection, ies, length * sizeof(*ies), &error
+	);
 	if (ret <= 0)
 		goto out;
 
-	write_may(this->ufd, ies, length * sizeof(*ies));
+	if (pending != NULL)
+		g_byte_array_append(
+			pending, (uint8_t *)ies, length * sizeof(*ies)
+		);
+	else
+		write_may(this->ufd, ies, length * sizeof(*ies));
 
 out:
 	if (ret < 0)
@@ -466,43 +1456,44 @@ out:
 	return ret;
 }
 
-static ssize_t send_card_path_msg(struct this *this, const char *card_path)
+static ssize_t send_card_path_msg(struct client *c, const char *card_path)
 {
 	ssize_t ret = 0;
 	size_t length = strlen(card_path) + 1;
 	g_autoptr(GError) error = NULL;
-	GOutputStream *os =
-		g_io_stream_get_output_stream(G_IO_STREAM(this->connection));
 
-	ret = rf_send_header(
-		this->connection, RF_MSG_TYPE_CARD_PATH, length, &error
+	ret = rf_send_msg(
+		c->connection,
+		RF_MSG_TYPE_CARD_PATH,
+		length,
+		card_path,
+		length,
+		NULL,
+		0,
+		&error
 	);
-	if (ret <= 0)
-		goto out;
-	ret = g_output_stream_write(os, card_path, length, NULL, &error);
-
-out:
 	if (ret < 0)
 		g_warning("DRM: Failed to send card path: %s.", error->message);
 	return ret;
 }
 
 static ssize_t
-send_connector_name_msg(struct this *this, const char *connector_name)
+send_connector_name_msg(struct client *c, const char *connector_name)
 {
 	ssize_t ret = 0;
 	size_t length = strlen(connector_name) + 1;
 	g_autoptr(GError) error = NULL;
-	GOutputStream *os =
-		g_io_stream_get_output_stream(G_IO_STREAM(this->connection));
 
-	ret = rf_send_header(
-		this->connection, RF_MSG_TYPE_CONNECTOR_NAME, length, &error
+	ret = rf_send_msg(
+		c->connection,
+		RF_MSG_TYPE_CONNECTOR_NAME,
+		length,
+		connector_name,
+		length,
+		NULL,
+		0,
+		&error
 	);
-	if (ret <= 0)
-		goto out;
-	ret = g_output_stream_write(os, connector_name, length, NULL, &error);
-out:
 	if (ret < 0)
 		g_warning(
 			"DRM: Failed to send connector name: %s.", error->message
@@ -510,60 +1501,99 @@ out:
 	return ret;
 }
 
-static inline char *get_connector_name(drmModeConnector *connector)
+static void wakeup_uinput_pointer(struct this *this, bool release)
 {
-	return g_strdup_printf(
-		"%s-%d",
-		drmModeGetConnectorTypeName(connector->connector_type),
-		connector->connector_type_id
-	);
+	// Because we are not a relative device, we cannot send relative events
+	// like moving pointer 1 unit right, instead, we move the pointer from
+	// bottom right to top left, this is done by sending two absolute events.
+	struct input_event ies[WAKEUP_POINTER_MAX_EVENTS];
+	memset(ies, 0, WAKEUP_POINTER_MAX_EVENTS * sizeof(*ies));
+
+	ies[0].type = EV_ABS;
+	ies[0].code = ABS_X;
+	ies[0].value = release ? 0 : RF_POINTER_MAX;
+
+	ies[1].type = EV_ABS;
+	ies[1].code = ABS_Y;
+	ies[1].value = release ? 0 : RF_POINTER_MAX;
+
+	ies[2].type = EV_SYN;
+	ies[2].code = SYN_REPORT;
+	ies[2].value = 0;
+
+	write_may(this->ufd, ies, WAKEUP_POINTER_MAX_EVENTS * sizeof(*ies));
 }
 
-static drmModeCrtc *get_crtc(int cfd, drmModeConnector *connector)
+static void wakeup_uinput_keyboard(struct this *this, bool release)
 {
-	drmModeEncoder *encoder = NULL;
-	drmModeCrtc *crtc = NULL;
-	encoder = drmModeGetEncoder(cfd, connector->encoder_id);
-	if (encoder == NULL)
-		return NULL;
-	crtc = drmModeGetCrtc(cfd, encoder->crtc_id);
-	drmModeFreeEncoder(encoder);
-	return crtc;
+	struct input_event ies[WAKEUP_KEYBOARD_MAX_EVENTS];
+	memset(ies, 0, WAKEUP_KEYBOARD_MAX_EVENTS * sizeof(*ies));
+
+	ies[0].type = EV_KEY;
+	ies[0].code = KEY_WAKEUP;
+	ies[0].value = release ? 0 : 1;
+
+	ies[1].type = EV_SYN;
+	ies[1].code = SYN_REPORT;
+	ies[1].value = 0;
+
+	write_may(this->ufd, ies, WAKEUP_KEYBOARD_MAX_EVENTS * sizeof(*ies));
 }
 
-static drmModeConnector *get_connector(int cfd, const char *connector_name)
+static void write_wakeup(struct this *this, bool release)
 {
-	drmModeConnector *connector = NULL;
-	drmModeRes *res = drmModeGetResources(cfd);
-	if (res == NULL) {
-		g_warning("DRM: Failed to get resources.");
-		return NULL;
+	if (rf_config_get_wakeup_device(this->config) ==
+	    RF_WAKEUP_DEVICE_POINTER)
+		wakeup_uinput_pointer(this, release);
+	else
+		wakeup_uinput_keyboard(this, release);
+}
+
+// Schedules wakeup events, main loop writes them when they are due. Returns
+// false if wakeup is disabled.
+static bool wakeup_uinput(struct this *this)
+{
+	if (!rf_config_get_wakeup(this->config))
+		return false;
+	// Another client already started it.
+	if (this->wakeup_press_time != 0 || this->wakeup_release_time != 0)
+		return true;
+
+	enum rf_wakeup_device wakeup_device =
+		rf_config_get_wakeup_device(this->config);
+	g_message(
+		"Input: Wakeup device is %s.",
+		wakeup_device == RF_WAKEUP_DEVICE_POINTER ? "pointer" :
+							    "keyboard"
+	);
+
+	// Userspace needs some time to detect a new uinput device, but a device
+	// kept from previous connections is ready to use.
+	const int64_t now = g_get_monotonic_time();
+	this->wakeup_press_time = this->uinput_time + UINPUT_SETTLE_TIME;
+	if (this->wakeup_press_time > now)
+		g_message(
+			"Input: Waiting for %.1fs to let userspace detect the uinput device before wakeup.",
+			(double)(this->wakeup_press_time - now) /
+				G_USEC_PER_SEC
+		);
+	else
+		this->wakeup_press_time = now;
+	return true;
+}
+
+static void dispatch_wakeup(struct this *this, int64_t now)
+{
+	if (this->wakeup_press_time != 0 && now >= this->wakeup_press_time) {
+		write_wakeup(this, false);
+		this->wakeup_press_time = 0;
+		this->wakeup_release_time = now + WAKEUP_RELEASE_DELAY;
 	}
-	if (connector_name != NULL)
-		g_debug("DRM: Finding connector for %s.", connector_name);
-	for (int i = 0; i < res->count_connectors; ++i) {
-		connector = drmModeGetConnector(cfd, res->connectors[i]);
-		if (connector == NULL)
-			continue;
-		g_autofree char *full_name = get_connector_name(connector);
-		bool connected = connector->connection == DRM_MODE_CONNECTED;
-		drmModeCrtc *crtc = get_crtc(cfd, connector);
-		bool has_crtc = crtc != NULL;
-		if (crtc != NULL)
-			drmModeFreeCrtc(crtc);
-		bool matched = connector_name == NULL ||
-			       g_strcmp0(full_name, connector_name) == 0;
-		g_debug("DRM: Connector %s is %s and %s.",
-			full_name,
-			connected ? "connected" : "disconnected",
-			has_crtc ? "has active CRTC" : "has no active CRTC");
-		if (connected && has_crtc && matched)
-			break;
-		drmModeFreeConnector(connector);
-		connector = NULL;
+	if (this->wakeup_release_time != 0 &&
+	    now >= this->wakeup_release_time) {
+		write_wakeup(this, true);
+		this->wakeup_release_time = 0;
 	}
-	drmModeFreeResources(res);
-	return connector;
 }
 
 static drmModeConnector *
@@ -584,7 +1614,8 @@ get_usable_card_and_connector(struct this *this, const char *connector_name)
 			continue;
 		g_debug("DRM: Finding the first usable connector on card %s.",
 			card_path);
-		drmModeConnector *connector = get_connector(cfd, connector_name);
+		drmModeConnector *connector =
+			get_connector(cfd, connector_name, true);
 		if (connector != NULL) {
 			this->cfd = cfd;
 			this->card_path = g_strdup(card_path);
@@ -614,145 +1645,248 @@ get_card_and_connector(struct this *this, const char *connector_name)
 		return NULL;
 	}
 	g_message("DRM: Opened card %s.", this->card_path);
-	return get_connector(this->cfd, connector_name);
+	return get_connector(this->cfd, connector_name, true);
+}
+
+static void free_client(struct client *c)
+{
+	g_clear_object(&c->connection);
+	g_clear_pointer(&c->connector_name, g_free);
+	g_clear_pointer(&c->wakeup_connector_name, g_free);
+	g_free(c);
 }
 
-static void setup_drm(struct this *this)
+static drmModeConnector *
+find_connector(struct this *this, const char *connector_name)
 {
-	this->crtc_id = 0;
-	this->primary_id = 0;
-	this->cursor_id = 0;
-	this->cursor = true;
+	if (this->cfd >= 0)
+		return get_connector(this->cfd, connector_name, true);
 
+	// All clients share the same card, so the first client decides which
+	// card to use if it is not set.
+	g_clear_pointer(&this->card_path, g_free);
 	this->card_path = rf_config_get_card_path(this->config);
-	this->connector_name = rf_config_get_connector(this->config);
 	drmModeConnector *connector =
-		get_card_and_connector(this, this->connector_name);
-	if (connector == NULL)
-		g_error("DRM: Failed to find a usable connector.");
+		get_card_and_connector(this, connector_name);
+	if (this->cfd < 0)
+		return connector;
 
 	// We may become DRM master if we are the first process that opens DRM
-	// card, then drop DRM master so we could start compositor after ReFrame.
+	// card, then drop DRM master so we could start compositor after
+	// ReFrame.
 	drmDropMaster(this->cfd);
-
-	if (this->connector_name == NULL)
-		this->connector_name = get_connector_name(connector);
-	g_message("DRM: Found usable connector %s.", this->connector_name);
-
-	drmModeCrtc *crtc = get_crtc(this->cfd, connector);
-	drmModeFreeConnector(connector);
-	if (crtc == NULL)
-		g_error("DRM: Failed to find an active CRTC for connector %s.",
-			this->connector_name);
-	this->crtc_id = crtc->crtc_id;
-	drmModeFreeCrtc(crtc);
-
 	// This is needed to get primary and cursor planes.
 	if (drmSetClientCap(this->cfd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) < 0)
 		g_warning("DRM: Failed to set universal planes capability.");
 	// This is needed to get `CRTC_X/Y` properties of planes.
 	if (drmSetClientCap(this->cfd, DRM_CLIENT_CAP_ATOMIC, 1) < 0)
 		g_warning("DRM: Failed to set atomic capability.");
+	// Writeback connectors are hidden without this.
+	if (this->writeback &&
+	    drmSetClientCap(
+		    this->cfd, DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1
+	    ) < 0)
+		g_warning(
+			"DRM: Failed to set writeback connectors capability."
+		);
+	return connector;
+}
 
-	this->primary_id =
-		get_plane_id(this->cfd, this->crtc_id, DRM_PLANE_TYPE_PRIMARY);
-	if (this->primary_id == 0)
-		g_error("DRM: Failed to find a primary plane for CRTC.");
-	this->cursor = rf_config_get_cursor(this->config);
-	g_message(
-		"DRM: Cursor plane is %s.", this->cursor ? "enabled" : "disabled"
-	);
+// Take over topology of the previous connection if nothing changed since it
+// disconnected, so we don't need to enumerate connectors and planes again.
+static bool reuse_topology(
+	struct this *this,
+	struct client *c,
+	const char *connector_name
+)
+{
+	struct client *idle = this->idle_client;
+	if (idle == NULL || this->cfd < 0 || idle->topology_dirty ||
+	    idle->crtc_id == 0 || idle->primary_plane.id == 0)
+		return false;
+	if (connector_name != NULL &&
+	    g_strcmp0(connector_name, idle->connector_name) != 0)
+		return false;
+	// Screen may be blanked while no one is connected, then we need to
+	// find topology again and wake it up.
+	uint64_t values[N_PLANE_PROPS];
+	if (!is_crtc_active(this->cfd, idle->crtc_id) ||
+	    get_plane_props(this->cfd, &idle->primary_plane, values) < 0 ||
+	    values[PLANE_PROP_FB_ID] == 0 ||
+	    values[PLANE_PROP_CRTC_ID] != idle->crtc_id)
+		return false;
+
+	c->connector_name = g_steal_pointer(&idle->connector_name);
+	c->crtc_id = idle->crtc_id;
+	c->crtc_width = idle->crtc_width;
+	c->crtc_height = idle->crtc_height;
+	c->primary_plane = idle->primary_plane;
+	c->cursor_plane = idle->cursor_plane;
+	c->cursor_retry_time = idle->cursor_retry_time;
+	// Forget plane snapshots so the first frame is a full one.
+	memset(c->primary_plane.values, 0, sizeof(c->primary_plane.values));
+	memset(c->cursor_plane.values, 0, sizeof(c->cursor_plane.values));
+	g_clear_pointer(&this->idle_client, free_client);
+	g_message("DRM: Reused topology of connector %s.", c->connector_name);
+	return true;
+}
 
-	send_card_path_msg(this, this->card_path);
-	send_connector_name_msg(this, this->connector_name);
+static bool has_active_crtc(struct this *this, drmModeConnector *connector)
+{
+	if (connector == NULL)
+		return false;
+	drmModeCrtc *crtc = get_crtc(this->cfd, connector);
+	if (crtc == NULL)
+		return false;
+	const bool active = is_crtc_active(this->cfd, crtc->crtc_id);
+	drmModeFreeCrtc(crtc);
+	return active;
 }
 
-static void clean_drm(struct this *this)
+// Returns false if wakeup is disabled or we already retried too many times.
+static bool wait_wakeup(struct this *this, struct client *c)
 {
-	if (this->cfd >= 0) {
-		close(this->cfd);
-		this->cfd = -1;
+	const int64_t now = g_get_monotonic_time();
+	if (c->wakeup_time == 0) {
+		if (!wakeup_uinput(this))
+			return false;
+		c->wakeup_retries = WAKEUP_RETRY_MAX;
+		// Start counting after the press is written.
+		c->wakeup_time = MAX(this->wakeup_press_time, now) +
+				 WAKEUP_RETRY_INTERVAL;
+		return true;
 	}
-	g_clear_pointer(&this->card_path, g_free);
-	g_clear_pointer(&this->connector_name, g_free);
+	if (c->wakeup_retries <= 0)
+		return false;
+	--c->wakeup_retries;
+	c->wakeup_time = now + WAKEUP_RETRY_INTERVAL;
+	return true;
 }
 
-static void wakeup_uinput_pointer(struct this *this)
+// Returns 1 if we are waiting for wakeup, main loop calls this again later.
+static int
+find_topology(struct this *this, struct client *c, const char *connector_name)
 {
-	// Because we are not a relative device, we cannot send relative events
-	// like moving pointer 1 unit right, instead, we move the pointer from
-	// bottom right to top left, this is done by sending two absolute events.
-	struct input_event ies[WAKEUP_POINTER_MAX_EVENTS];
-	memset(ies, 0, WAKEUP_POINTER_MAX_EVENTS * sizeof(*ies));
-
-	ies[0].type = EV_ABS;
-	ies[0].code = ABS_X;
-	ies[0].value = RF_POINTER_MAX;
-
-	ies[1].type = EV_ABS;
-	ies[1].code = ABS_Y;
-	ies[1].value = RF_POINTER_MAX;
-
-	ies[2].type = EV_SYN;
-	ies[2].code = SYN_REPORT;
-	ies[2].value = 0;
-
-	write_may(this->ufd, ies, WAKEUP_POINTER_MAX_EVENTS * sizeof(*ies));
-
-	g_message(
-		"Input: Waiting for 0.1s to let userspace process the movement."
-	);
-	g_usleep(0.1 * G_USEC_PER_SEC);
-
-	ies[0].value = 0;
+	drmModeConnector *connector = find_connector(this, connector_name);
+	// If screen is turned off, we cannot get CRTC or it is inactive, so we
+	// have to wake it up and wait for compositor to enable CRTC.
+	if (!has_active_crtc(this, connector) && wait_wakeup(this, c)) {
+		g_clear_pointer(&connector, drmModeFreeConnector);
+		return 1;
+	}
+	c->wakeup_time = 0;
+	if (connector == NULL) {
+		g_warning("DRM: Failed to find a usable connector.");
+		return -1;
+	}
 
-	ies[1].value = 0;
+	c->connector_name = connector_name != NULL ?
+				    g_strdup(connector_name) :
+				    get_connector_name(connector);
+	g_message("DRM: Found usable connector %s.", c->connector_name);
+	drmModeFreeConnector(connector);
 
-	write_may(this->ufd, ies, WAKEUP_POINTER_MAX_EVENTS * sizeof(*ies));
+	update_topology(this, c);
+	if (c->crtc_id == 0) {
+		g_warning(
+			"DRM: Failed to find an active CRTC for connector %s.",
+			c->connector_name
+		);
+		return -1;
+	}
+	if (c->primary_plane.id == 0) {
+		g_warning("DRM: Failed to find a primary plane for CRTC.");
+		return -1;
+	}
+	return 0;
 }
 
-static void wakeup_uinput_keyboard(struct this *this)
+static int send_topology(struct this *this, struct client *c)
 {
-	struct input_event ies[WAKEUP_KEYBOARD_MAX_EVENTS];
-	memset(ies, 0, WAKEUP_KEYBOARD_MAX_EVENTS * sizeof(*ies));
-
-	ies[0].type = EV_KEY;
-	ies[0].code = KEY_WAKEUP;
-	ies[0].value = 1;
-
-	ies[1].type = EV_SYN;
-	ies[1].code = SYN_REPORT;
-	ies[1].value = 0;
-
-	write_may(this->ufd, ies, WAKEUP_KEYBOARD_MAX_EVENTS * sizeof(*ies));
+	if (send_card_path_msg(c, this->card_path) <= 0)
+		return -1;
+	if (send_connector_name_msg(c, c->connector_name) <= 0)
+		return -1;
+	return 0;
+}
 
-	g_message("Input: Waiting for 0.1s to let userspace process the press.");
-	g_usleep(0.1 * G_USEC_PER_SEC);
+static int
+setup_drm(struct this *this, struct client *c, const char *connector_name)
+{
+	c->crtc_id = 0;
+	reset_slots(c);
+	setup_plane(this->cfd, &c->primary_plane, 0);
+	setup_plane(this->cfd, &c->cursor_plane, 0);
+	c->cursor_retry_time = 0;
+
+	if (!reuse_topology(this, c, connector_name)) {
+		const int ret = find_topology(this, c, connector_name);
+		if (ret < 0)
+			return -1;
+		// Topology is sent by `retry_topology()` after wakeup.
+		if (ret > 0) {
+			c->wakeup_connector_name = g_strdup(connector_name);
+			return 0;
+		}
+	}
+	return send_topology(this, c);
+}
 
-	ies[0].value = 0;
+static ssize_t retry_topology(struct this *this, struct client *c)
+{
+	const int ret = find_topology(this, c, c->wakeup_connector_name);
+	if (ret > 0)
+		return 1;
+	g_clear_pointer(&c->wakeup_connector_name, g_free);
+	if (ret < 0 || send_topology(this, c) < 0)
+		return -1;
+	return 1;
+}
 
-	write_may(this->ufd, ies, WAKEUP_KEYBOARD_MAX_EVENTS * sizeof(*ies));
+static void clean_drm(struct this *this)
+{
+	if (this->cfd >= 0) {
+		close(this->cfd);
+		this->cfd = -1;
+	}
+	g_clear_pointer(&this->card_path, g_free);
 }
 
-static void wakeup_uinput(struct this *this)
+static ssize_t
+on_connector_name_msg(struct this *this, struct client *c, size_t length)
 {
-	enum rf_wakeup_device wakeup_device =
-		rf_config_get_wakeup_device(this->config);
-	g_message(
-		"Input: Wakeup device is %s.",
-		wakeup_device == RF_WAKEUP_DEVICE_POINTER ? "pointer" :
-							    "keyboard"
-	);
+	g_autofree char *msg = NULL;
+	g_autofree char *connector_name = NULL;
+	ssize_t ret = 0;
+	g_autoptr(GError) error = NULL;
 
-	g_message(
-		"Input: Waiting for 1s to let userspace detect the uinput device before wakeup."
-	);
-	g_usleep(G_USEC_PER_SEC);
+	if (length == 0) {
+		ret = -1;
+		goto out;
+	}
+	msg = g_malloc0(length);
+	ret = rf_receive_payload(c->connection, msg, length, &error);
+	if (ret <= 0)
+		goto out;
+	// We don't support switching connector.
+	if (c->connector_name != NULL || c->wakeup_time != 0)
+		goto out;
+
+	g_debug("DRM: Received connector name %s.", msg);
+	// Empty name means Server does not select connector, fallback to ours.
+	connector_name = msg[0] != '\0' ?
+				 g_strdup(msg) :
+				 rf_config_get_connector(this->config);
+	if (setup_drm(this, c, connector_name) < 0)
+		ret = -1;
 
-	if (wakeup_device == RF_WAKEUP_DEVICE_POINTER)
-		wakeup_uinput_pointer(this);
-	else
-		wakeup_uinput_keyboard(this);
+out:
+	if (ret < 0 && error != NULL)
+		g_warning(
+			"DRM: Failed to receive connector name: %s.",
+			error->message
+		);
+	return ret;
 }
 
 static void setup_uinput(struct this *this)
@@ -806,11 +1940,7 @@ static void setup_uinput(struct this *this)
 	strcpy(dev.name, "reframe");
 	ioctl_must(this->ufd, UI_DEV_SETUP, &dev);
 	ioctl_must(this->ufd, UI_DEV_CREATE);
-
-	// If screen is turned off, we cannot get CRTC, so we have to wake it up.
-	bool wakeup = rf_config_get_wakeup(this->config);
-	if (wakeup)
-		wakeup_uinput(this);
+	this->uinput_time = g_get_monotonic_time();
 }
 
 static void clean_uinput(struct this *this)
@@ -820,6 +1950,725 @@ static void clean_uinput(struct this *this)
 		close(this->ufd);
 		this->ufd = -1;
 	}
+	this->wakeup_press_time = 0;
+	this->wakeup_release_time = 0;
+}
+
+static ssize_t on_input_channel_in(
+	struct this *this,
+	GSocketConnection *channel,
+	GByteArray *pending
+)
+{
+	ssize_t ret = 0;
+	g_autoptr(GError) error = NULL;
+	char type;
+	size_t length = 0;
+	ret = rf_receive_header(channel, &type, &length, NULL, NULL, &error);
+	if (ret <= 0) {
+		if (ret < 0)
+			g_warning(
+				"Input: Failed to read message header: %s.",
+				error->message
+			);
+		return ret;
+	}
+
+	// Only input messages are allowed in input channel.
+	if (type != RF_MSG_TYPE_INPUT)
+		return -1;
+	return on_input_msg(this, channel, length, pending);
+}
+
+static GSocketConnection *make_input_channel(int fd)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(GSocket) socket = g_socket_new_from_fd(fd, &error);
+	if (socket == NULL) {
+		g_warning(
+			"Input: Failed to create input channel: %s.",
+			error->message
+		);
+		close(fd);
+		return NULL;
+	}
+	g_debug("Input: Added input channel.");
+	return g_socket_connection_factory_create_connection(socket);
+}
+
+#ifdef HAVE_LIBURING
+enum uring_op_type { URING_OP_PIPE, URING_OP_CHANNEL };
+
+struct uring_op {
+	enum uring_op_type type;
+	// Channels are received by the ring directly, so we keep the fd
+	// instead of a connection.
+	int fd;
+	// Message framing is the same as `rf_receive_header()`, but input
+	// channel never carries fds.
+	char header[sizeof(char) + sizeof(size_t)];
+	GByteArray *buf;
+	size_t offset;
+	bool payload;
+};
+
+static void free_uring_op(struct uring_op *op)
+{
+	if (op->type == URING_OP_CHANNEL && op->fd >= 0)
+		close(op->fd);
+	g_clear_pointer(&op->buf, g_byte_array_unref);
+	g_free(op);
+}
+
+static struct io_uring_sqe *get_sqe(struct io_uring *ring)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+	// Submission queue is full, flush it and try again.
+	if (sqe == NULL) {
+		io_uring_submit(ring);
+		sqe = io_uring_get_sqe(ring);
+	}
+	return sqe;
+}
+
+// Polls are one shot, so we arm them again after handling.
+static void arm_uring_poll(struct io_uring *ring, int fd, struct uring_op *op)
+{
+	struct io_uring_sqe *sqe = get_sqe(ring);
+	io_uring_prep_poll_add(sqe, fd, POLLIN);
+	io_uring_sqe_set_data(sqe, op);
+}
+
+// Receives the rest of header or payload, short reads are continued by the
+// next completion.
+static void arm_uring_channel(struct io_uring *ring, struct uring_op *op)
+{
+	uint8_t *data = op->payload ? op->buf->data : (uint8_t *)op->header;
+	const size_t size = op->payload ? op->buf->len : sizeof(op->header);
+	struct io_uring_sqe *sqe = get_sqe(ring);
+	io_uring_prep_recv(
+		sqe, op->fd, data + op->offset, size - op->offset, 0
+	);
+	io_uring_sqe_set_data(sqe, op);
+}
+
+static struct uring_op *make_uring_channel(int fd)
+{
+	g_autoptr(GError) error = NULL;
+	// Kernel waits for data inside the ring for a blocking socket, instead
+	// of completing with `-EAGAIN`.
+	if (!g_unix_set_fd_nonblocking(fd, false, &error)) {
+		g_warning(
+			"Input: Failed to create input channel: %s.",
+			error->message
+		);
+		close(fd);
+		return NULL;
+	}
+	struct uring_op *op = g_malloc0(sizeof(*op));
+	op->type = URING_OP_CHANNEL;
+	op->fd = fd;
+	op->buf = g_byte_array_new();
+	g_debug("Input: Added input channel.");
+	return op;
+}
+
+// Returns false if channel should be removed.
+static bool
+on_uring_channel(struct uring_op *op, int res, GByteArray *pending)
+{
+	if (res == -EINTR || res == -EAGAIN)
+		return true;
+	if (res <= 0) {
+		if (res < 0)
+			g_warning(
+				"Input: Failed to receive message: %s.",
+				strerror(-res)
+			);
+		return false;
+	}
+	op->offset += res;
+	const size_t size = op->payload ? op->buf->len : sizeof(op->header);
+	if (op->offset < size)
+		return true;
+
+	op->offset = 0;
+	if (op->payload) {
+		g_byte_array_append(pending, op->buf->data, op->buf->len);
+		g_debug("Input: Received %u bytes input events.", op->buf->len);
+		op->payload = false;
+		return true;
+	}
+	// Only input messages are allowed in input channel.
+	if (op->header[0] != RF_MSG_TYPE_INPUT)
+		return false;
+	size_t length = 0;
+	memcpy(&length, &op->header[sizeof(char)], sizeof(length));
+	if (length == 0)
+		return true;
+	g_byte_array_set_size(op->buf, length * sizeof(struct input_event));
+	op->payload = true;
+	return true;
+}
+
+// Handles a completion, returns false if input thread should quit.
+static bool on_uring_cqe(
+	struct this *this,
+	struct io_uring *ring,
+	GPtrArray *ops,
+	struct uring_op *op,
+	int res,
+	GByteArray *pending
+)
+{
+	switch (op->type) {
+	case URING_OP_PIPE: {
+		int fd = -1;
+		if (res < 0 ||
+		    read(this->input_pipe[0], &fd, sizeof(fd)) != sizeof(fd) ||
+		    fd < 0)
+			return false;
+		arm_uring_poll(ring, this->input_pipe[0], op);
+		struct uring_op *channel_op = make_uring_channel(fd);
+		if (channel_op == NULL)
+			break;
+		g_ptr_array_add(ops, channel_op);
+		arm_uring_channel(ring, channel_op);
+		break;
+	}
+	case URING_OP_CHANNEL:
+		if (!on_uring_channel(op, res, pending)) {
+			g_ptr_array_remove_fast(ops, op);
+			g_debug("Input: Removed input channel.");
+			break;
+		}
+		arm_uring_channel(ring, op);
+		break;
+	default:
+		break;
+	}
+	return true;
+}
+
+// Receiving input messages is submitted together with waiting, so an input
+// burst costs 1 syscall for the ring and 1 for uinput. uinput does not support
+// nowait, so io_uring would hand writes to workers that may complete them out
+// of order, we write it inline instead to keep the order of events.
+static bool input_thread_uring(struct this *this)
+{
+	struct io_uring ring;
+	const int ret = io_uring_queue_init(URING_ENTRIES, &ring, 0);
+	if (ret < 0) {
+		g_message(
+			"Input: Failed to setup io_uring, fallback to poll: %s.",
+			strerror(-ret)
+		);
+		return false;
+	}
+	g_message("Input: Using io_uring input loop.");
+
+	g_autoptr(GPtrArray) ops =
+		g_ptr_array_new_with_free_func((GDestroyNotify)free_uring_op);
+	struct uring_op *pipe_op = g_malloc0(sizeof(*pipe_op));
+	pipe_op->type = URING_OP_PIPE;
+	g_ptr_array_add(ops, pipe_op);
+	arm_uring_poll(&ring, this->input_pipe[0], pipe_op);
+
+	bool running = true;
+	while (running) {
+		const int n = io_uring_submit_and_wait(&ring, 1);
+		if (n < 0 && n != -EINTR)
+			g_error("Input: Failed to wait io_uring: %s.",
+				strerror(-n));
+
+		g_autoptr(GByteArray) pending = g_byte_array_new();
+		struct io_uring_cqe *cqe = NULL;
+		while (running && io_uring_peek_cqe(&ring, &cqe) == 0) {
+			struct uring_op *op = io_uring_cqe_get_data(cqe);
+			const int res = cqe->res;
+			io_uring_cqe_seen(&ring, cqe);
+			running = on_uring_cqe(
+				this, &ring, ops, op, res, pending
+			);
+		}
+		if (pending->len > 0)
+			write_may(
+				this->ufd, pending->data, (size_t)pending->len
+			);
+	}
+
+	// Kernel cancels pending polls when closing ring, only then it is safe
+	// to free ops.
+	io_uring_queue_exit(&ring);
+	return true;
+}
+#endif
+
+static void input_thread_poll(struct this *this)
+{
+	g_autoptr(GPtrArray) channels =
+		g_ptr_array_new_with_free_func(g_object_unref);
+	g_autofree struct pollfd *pfds = NULL;
+
+	while (true) {
+		// Pipe and channels.
+		const unsigned int n_pfds = 1 + channels->len;
+		pfds = g_renew(struct pollfd, pfds, n_pfds);
+		pfds[0].fd = this->input_pipe[0];
+		pfds[0].events = POLLIN;
+		for (unsigned int i = 0; i < channels->len; ++i) {
+			GSocket *socket = g_socket_connection_get_socket(
+				g_ptr_array_index(channels, i)
+			);
+			pfds[1 + i].fd = g_socket_get_fd(socket);
+			pfds[1 + i].events = POLLIN;
+		}
+		for (unsigned int i = 0; i < n_pfds; ++i)
+			pfds[i].revents = 0;
+
+		if (poll(pfds, n_pfds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			g_error("Input: Failed to poll: %s.", strerror(errno));
+		}
+
+		g_autoptr(GByteArray) pending = g_byte_array_new();
+		for (unsigned int i = channels->len; i > 0; --i) {
+			if (pfds[1 + i - 1].revents == 0)
+				continue;
+			if (on_input_channel_in(
+				    this,
+				    g_ptr_array_index(channels, i - 1),
+				    pending
+			    ) <= 0) {
+				g_ptr_array_remove_index(channels, i - 1);
+				g_debug("Input: Removed input channel.");
+			}
+		}
+		if (pending->len > 0)
+			write_may(
+				this->ufd, pending->data, (size_t)pending->len
+			);
+		if (pfds[0].revents != 0) {
+			int fd = -1;
+			if (read(this->input_pipe[0], &fd, sizeof(fd)) !=
+				    sizeof(fd) ||
+			    fd < 0)
+				break;
+			GSocketConnection *channel = make_input_channel(fd);
+			if (channel != NULL)
+				g_ptr_array_add(channels, channel);
+		}
+	}
+}
+
+// Writing to uinput never waits for exporting framebuffers in main thread, so
+// typing latency does not depend on capturing cost. Events from all ready
+// channels are written in one batch.
+static void *input_thread(void *data)
+{
+	struct this *this = data;
+#ifdef HAVE_LIBURING
+	if (input_thread_uring(this))
+		return NULL;
+#endif
+	input_thread_poll(this);
+	return NULL;
+}
+
+static void setup_input_thread(struct this *this)
+{
+	g_autoptr(GError) error = NULL;
+	if (!g_unix_open_pipe(this->input_pipe, FD_CLOEXEC, &error))
+		g_error("Input: Failed to create pipe: %s.", error->message);
+	this->input_thread = g_thread_new("input", input_thread, this);
+}
+
+static void clean_input_thread(struct this *this)
+{
+	if (this->input_thread == NULL)
+		return;
+
+	// Negative fd tells input thread to quit.
+	int fd = -1;
+	write_may(this->input_pipe[1], &fd, sizeof(fd));
+	g_clear_pointer(&this->input_thread, g_thread_join);
+	close(this->input_pipe[0]);
+	close(this->input_pipe[1]);
+	this->input_pipe[0] = -1;
+	this->input_pipe[1] = -1;
+}
+
+static ssize_t on_input_channel_msg(
+	struct this *this,
+	struct client *c,
+	size_t length,
+	int *fds,
+	int n_fds
+)
+{
+	g_debug("Input: Received input channel message.");
+
+	if (length != 1 || n_fds != 1) {
+		g_warning(
+			"Input: Expect 1 fd for input channel but got %d.",
+			n_fds
+		);
+		for (int i = 0; i < n_fds; ++i)
+			close(fds[i]);
+		return -1;
+	}
+
+	// Input thread takes the ownership of fd.
+	write_may(this->input_pipe[1], &fds[0], sizeof(fds[0]));
+	return 1;
+}
+
+static struct client *find_client(struct this *this, uint64_t id)
+{
+	for (unsigned int i = 0; i < this->clients->len; ++i) {
+		struct client *c = g_ptr_array_index(this->clients, i);
+		if (c->id == id)
+			return c;
+	}
+	return NULL;
+}
+
+static void add_client(struct this *this, GSocketConnection *connection)
+{
+	// uinput device and DRM card are shared, so they are only created for
+	// the first client.
+	if (this->ufd < 0) {
+		setup_uinput(this);
+		setup_input_thread(this);
+	}
+
+	struct client *c = g_malloc0(sizeof(*c));
+	c->id = this->next_client_id++;
+	c->connection = connection;
+	c->writeback.fence = -1;
+	g_socket_set_timeout(
+		g_socket_connection_get_socket(connection), CLIENT_TIMEOUT
+	);
+	g_ptr_array_add(this->clients, c);
+	g_message("ReFrame Server connected.");
+}
+
+static void remove_client(struct this *this, unsigned int i)
+{
+	struct client *c = g_ptr_array_steal_index(this->clients, i);
+	clean_writeback(this, &c->writeback);
+	g_clear_object(&c->connection);
+	g_message("ReFrame Server disconnected.");
+	// Keep topology for the next connection, only if it is complete.
+	if (c->crtc_id != 0 && c->primary_plane.id != 0) {
+		g_clear_pointer(&this->idle_client, free_client);
+		this->idle_client = c;
+	} else {
+		free_client(c);
+	}
+	if (this->clients->len == 0) {
+		this->idle_time = g_get_monotonic_time();
+		g_message(
+			"Keeping devices for %ds after the last disconnection.",
+			(int)(IDLE_TIMEOUT / G_USEC_PER_SEC)
+		);
+	}
+}
+
+static void clean_devices(struct this *this)
+{
+	g_clear_pointer(&this->idle_client, free_client);
+	clean_drm(this);
+	clean_input_thread(this);
+	clean_uinput(this);
+}
+
+// Negative means no timeout.
+static int get_idle_timeout(struct this *this)
+{
+	if (this->clients->len > 0 || this->ufd < 0)
+		return -1;
+	const int64_t remain =
+		this->idle_time + IDLE_TIMEOUT - g_get_monotonic_time();
+	return remain > 0 ? (int)(remain / 1000) + 1 : 0;
+}
+
+// Merges a monotonic deadline into poll timeout, 0 deadline is ignored.
+static int merge_timeout(int timeout, int64_t time, int64_t now)
+{
+	if (time == 0)
+		return timeout;
+	const int64_t remain = time - now;
+	const int t = remain > 0 ? (int)(remain / 1000) + 1 : 0;
+	return timeout < 0 ? t : MIN(timeout, t);
+}
+
+// Wakeup is driven by poll timeout instead of sleeping, so other clients are
+// still served while we wait.
+static int get_timeout(struct this *this)
+{
+	const int64_t now = g_get_monotonic_time();
+	int timeout = get_idle_timeout(this);
+	timeout = merge_timeout(timeout, this->wakeup_press_time, now);
+	timeout = merge_timeout(timeout, this->wakeup_release_time, now);
+	for (unsigned int i = 0; i < this->clients->len; ++i) {
+		struct client *c = g_ptr_array_index(this->clients, i);
+		timeout = merge_timeout(timeout, c->wakeup_time, now);
+	}
+	return timeout;
+}
+
+// `drmHandleEvent()` does not pass us any context except the user data, so we
+// parse events by ourselves.
+static void on_drm_in(struct this *this)
+{
+	char buf[1024];
+	const ssize_t length = read(this->cfd, buf, sizeof(buf));
+	if (length < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			g_warning("DRM: Failed to read events: %s.",
+				  strerror(errno));
+		return;
+	}
+	ssize_t i = 0;
+	while (i + (ssize_t)sizeof(struct drm_event) <= length) {
+		const struct drm_event *e = (struct drm_event *)&buf[i];
+		if (e->length < sizeof(*e) || i + e->length > length)
+			break;
+		if (e->type == DRM_EVENT_CRTC_SEQUENCE) {
+			const struct drm_event_crtc_sequence *seq =
+				(struct drm_event_crtc_sequence *)e;
+			struct client *c = find_client(this, seq->user_data);
+			if (c != NULL)
+				c->vblank = true;
+		}
+		i += e->length;
+	}
+}
+
+static void setup_monitor(struct this *this)
+{
+#ifdef HAVE_LIBUDEV
+	this->udev = udev_new();
+	if (this->udev == NULL) {
+		g_warning("DRM: Failed to create udev context.");
+		return;
+	}
+	this->monitor = udev_monitor_new_from_netlink(this->udev, "udev");
+	if (this->monitor == NULL) {
+		g_warning("DRM: Failed to create udev monitor.");
+		return;
+	}
+	udev_monitor_filter_add_match_subsystem_devtype(
+		this->monitor, "drm", "drm_minor"
+	);
+	if (udev_monitor_enable_receiving(this->monitor) < 0) {
+		g_warning("DRM: Failed to enable udev monitor.");
+		g_clear_pointer(&this->monitor, udev_monitor_unref);
+	}
+#else
+	g_message(
+		"DRM: Built without libudev, topology is only updated on plane state mismatch."
+	);
+#endif
+}
+
+static void clean_monitor(struct this *this)
+{
+#ifdef HAVE_LIBUDEV
+	g_clear_pointer(&this->monitor, udev_monitor_unref);
+	g_clear_pointer(&this->udev, udev_unref);
+#endif
+}
+
+static int get_monitor_fd(struct this *this)
+{
+#ifdef HAVE_LIBUDEV
+	if (this->monitor != NULL)
+		return udev_monitor_get_fd(this->monitor);
+#endif
+	return -1;
+}
+
+// Kernel sends `HOTPLUG=1` on connector changes and `LEASE=1` on lease
+// changes, we check topology again for all clients.
+static void on_monitor_in(struct this *this)
+{
+#ifdef HAVE_LIBUDEV
+	struct udev_device *dev = udev_monitor_receive_device(this->monitor);
+	if (dev == NULL)
+		return;
+	const char *hotplug = udev_device_get_property_value(dev, "HOTPLUG");
+	const char *lease = udev_device_get_property_value(dev, "LEASE");
+	const bool changed = g_strcmp0(hotplug, "1") == 0 ||
+			     g_strcmp0(lease, "1") == 0;
+	const dev_t devnum = udev_device_get_devnum(dev);
+	udev_device_unref(dev);
+
+	struct stat st;
+	if (!changed || this->cfd < 0 || fstat(this->cfd, &st) != 0 ||
+	    st.st_rdev != devnum)
+		return;
+
+	g_message("DRM: Got hotplug event for card %s.", this->card_path);
+	for (unsigned int i = 0; i < this->clients->len; ++i) {
+		struct client *c = g_ptr_array_index(this->clients, i);
+		c->topology_dirty = true;
+		c->topology_retry_time = 0;
+		// Vblank may never come if CRTC is disabled, check it now.
+		if (c->frame_pending)
+			c->vblank = true;
+	}
+	if (this->idle_client != NULL)
+		this->idle_client->topology_dirty = true;
+#endif
+}
+
+static ssize_t on_socket_in(struct this *this, struct client *c)
+{
+	ssize_t ret = 0;
+	g_autoptr(GError) error = NULL;
+	g_autofree int *fds = NULL;
+	int n_fds = 0;
+	char type;
+	size_t length = 0;
+	ret = rf_receive_header(
+		c->connection, &type, &length, &fds, &n_fds, &error
+	);
+	if (ret <= 0) {
+		if (ret < 0)
+			g_warning(
+				"Failed to read message header: %s.",
+				error->message
+			);
+		return ret;
+	}
+
+	switch (type) {
+	case RF_MSG_TYPE_FRAME:
+		ret = on_frame_msg(this, c, length);
+		break;
+	case RF_MSG_TYPE_INPUT:
+		ret = on_input_msg(this, c->connection, length, NULL);
+		break;
+	case RF_MSG_TYPE_INPUT_CHANNEL:
+		ret = on_input_channel_msg(this, c, length, fds, n_fds);
+		n_fds = 0;
+		break;
+	case RF_MSG_TYPE_CONNECTOR_NAME:
+		ret = on_connector_name_msg(this, c, length);
+		break;
+	case RF_MSG_TYPE_AUTH:
+		ret = on_auth_msg(this, c, length);
+		break;
+	default:
+		break;
+	}
+	// Only input channel message carries fds.
+	for (int i = 0; i < n_fds; ++i)
+		close(fds[i]);
+	return ret;
+}
+
+static void on_listener_in(struct this *this, GSocketListener *listener)
+{
+	g_autoptr(GError) error = NULL;
+	GSocketConnection *connection =
+		g_socket_listener_accept(listener, NULL, NULL, &error);
+	if (connection == NULL) {
+		g_warning("Failed to accept connection: %s.", error->message);
+		return;
+	}
+
+	GSocket *socket = g_socket_connection_get_socket(connection);
+	const pid_t pid = rf_get_socket_pid(socket);
+	if (auth_pid(this, pid, BINDIR G_DIR_SEPARATOR_S "reframe-server") !=
+	    0) {
+		g_warning("Got disallowed socket client PID %d.", pid);
+		// Dropping the last reference of it will automatically close
+		// IO streams and socket.
+		g_object_unref(connection);
+		return;
+	}
+
+	add_client(this, connection);
+}
+
+// Returns when all clients disconnected and devices are closed.
+static void
+run(struct this *this, GSocketListener *listener, GSocket *listen_socket)
+{
+	g_autofree struct pollfd *pfds = NULL;
+	do {
+		// Listener, DRM card, udev monitor, clients and their writeback
+		// fences.
+		const unsigned int n_clients = this->clients->len;
+		const unsigned int n_pfds = 3 + 2 * n_clients;
+		pfds = g_renew(struct pollfd, pfds, n_pfds);
+		pfds[0].fd = g_socket_get_fd(listen_socket);
+		pfds[0].events = POLLIN;
+		// We only need DRM events in push mode, negative fd is ignored.
+		pfds[1].fd = this->push ? this->cfd : -1;
+		pfds[1].events = POLLIN;
+		pfds[2].fd = get_monitor_fd(this);
+		pfds[2].events = POLLIN;
+		for (unsigned int i = 0; i < this->clients->len; ++i) {
+			struct client *c = g_ptr_array_index(this->clients, i);
+			GSocket *socket =
+				g_socket_connection_get_socket(c->connection);
+			pfds[3 + i].fd = g_socket_get_fd(socket);
+			pfds[3 + i].events = POLLIN;
+			pfds[3 + n_clients + i].fd = c->writeback.fence;
+			pfds[3 + n_clients + i].events = POLLIN;
+		}
+		for (unsigned int i = 0; i < n_pfds; ++i)
+			pfds[i].revents = 0;
+
+		const int n = poll(pfds, n_pfds, get_timeout(this));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			g_error("Failed to poll: %s.", strerror(errno));
+		}
+		if (n == 0 && get_idle_timeout(this) == 0) {
+			g_message(
+				"No ReFrame Server connected, closing devices."
+			);
+			clean_devices(this);
+			continue;
+		}
+
+		if (pfds[1].revents != 0)
+			on_drm_in(this);
+		if (pfds[2].revents != 0)
+			on_monitor_in(this);
+		const int64_t now = g_get_monotonic_time();
+		dispatch_wakeup(this, now);
+		// Iterate backward so we could remove clients. New clients are
+		// appended after those, so do this before accepting.
+		for (unsigned int i = this->clients->len; i > 0; --i) {
+			struct client *c =
+				g_ptr_array_index(this->clients, i - 1);
+			ssize_t ret = 1;
+			if (pfds[3 + n_clients + i - 1].revents != 0)
+				ret = on_writeback_fence(this, c);
+			if (ret > 0 && pfds[3 + i - 1].revents != 0)
+				ret = on_socket_in(this, c);
+			if (ret > 0 && c->wakeup_time != 0 &&
+			    now >= c->wakeup_time)
+				ret = retry_topology(this, c);
+			if (ret > 0 && c->vblank) {
+				c->vblank = false;
+				if (c->frame_pending)
+					ret = check_frame(this, c);
+			}
+			if (ret <= 0)
+				remove_client(this, i - 1);
+		}
+		if (pfds[0].revents != 0)
+			on_listener_in(this, listener);
+	} while (this->clients->len > 0 || this->ufd >= 0);
 }
 
 static void on_sigint(int sig)
@@ -917,118 +2766,80 @@ int main(int argc, char *argv[])
 	g_message("Using socket %s.", socket_path);
 
 	g_autofree struct this *this = g_malloc0(sizeof(*this));
+	this->clients = g_ptr_array_new_with_free_func((GDestroyNotify)free_client);
+	this->next_client_id = 1;
 	this->cfd = -1;
 	this->ufd = -1;
+	this->idle_client = NULL;
+	this->input_pipe[0] = -1;
+	this->input_pipe[1] = -1;
+	this->input_thread = NULL;
 	this->skip_auth = skip_auth;
 	this->config = rf_config_new(config_path);
+	this->cursor = rf_config_get_cursor(this->config);
+	g_message(
+		"DRM: Cursor plane is %s.", this->cursor ? "enabled" : "disabled"
+	);
+	this->push = rf_config_get_push(this->config);
+	g_message("Frame: Push mode is %s.", this->push ? "enabled" : "disabled");
+	this->skip_unchanged =
+		this->push || rf_config_get_skip_unchanged(this->config);
+	this->writeback = rf_config_get_writeback(this->config);
+	g_message(
+		"DRM: Writeback is %s.",
+		this->writeback ? "enabled" : "disabled"
+	);
+	setup_monitor(this);
 
 	g_autoptr(GSocketListener) listener = g_socket_listener_new();
+	// We need the socket to poll it together with clients.
+	g_autoptr(GSocket) listen_socket = NULL;
 
 #ifdef HAVE_LIBSYSTEMD
 	if (sd_listen_fds(0) != 0) {
 		// systemd socket.
 		// We only handle 1 socket.
 		const int sfd = SD_LISTEN_FDS_START;
-		g_autoptr(GSocket) socket = g_socket_new_from_fd(sfd, &error);
+		listen_socket = g_socket_new_from_fd(sfd, &error);
 		if (error != NULL)
 			g_error("Failed to create socket from systemd fd: %s.",
 				error->message);
-		g_socket_listener_add_socket(listener, socket, NULL, &error);
 	} else {
 #endif
 		// Non-systemd socket.
 		g_autoptr(GSocketAddress)
 			address = g_unix_socket_address_new(socket_path);
 		g_remove(socket_path);
-		g_socket_listener_add_address(
-			listener,
-			address,
+		listen_socket = g_socket_new(
+			G_SOCKET_FAMILY_UNIX,
 			G_SOCKET_TYPE_STREAM,
 			G_SOCKET_PROTOCOL_DEFAULT,
-			NULL,
-			NULL,
 			&error
 		);
-		rf_set_group(socket_path);
-		g_chmod(socket_path, 0660);
+		if (listen_socket != NULL &&
+		    g_socket_bind(listen_socket, address, true, &error) &&
+		    g_socket_listen(listen_socket, &error)) {
+			rf_set_group(socket_path);
+			g_chmod(socket_path, 0660);
+		}
 #ifdef HAVE_LIBSYSTEMD
 	}
 #endif
+	if (error == NULL)
+		g_socket_listener_add_socket(
+			listener, listen_socket, NULL, &error
+		);
 	if (error != NULL)
 		g_error("Failed to listen to socket: %s.", error->message);
 
 	signal(SIGINT, on_sigint);
 	do {
-		this->connection =
-			g_socket_listener_accept(listener, NULL, NULL, &error);
-		if (this->connection == NULL)
-			g_error("Failed to accept connection: %s.",
-				error->message);
-
-		GSocket *socket =
-			g_socket_connection_get_socket(this->connection);
-		const pid_t pid = rf_get_socket_pid(socket);
-		if (auth_pid(
-			    this, pid, BINDIR G_DIR_SEPARATOR_S "reframe-server"
-		    ) != 0) {
-			g_warning("Got disallowed socket client PID %d.", pid);
-			goto close;
-		}
-
-		g_message("ReFrame Server connected.");
-
-		setup_uinput(this);
-		setup_drm(this);
-
-		while (true) {
-			ssize_t ret = 0;
-			GInputStream *is = g_io_stream_get_input_stream(
-				G_IO_STREAM(this->connection)
-			);
-			char type;
-			ret = g_input_stream_read(
-				is, &type, sizeof(type), NULL, &error
-			);
-			if (ret <= 0) {
-				if (ret < 0) {
-					g_warning(
-						"Failed to read message type: %s.",
-						error->message
-					);
-					g_clear_pointer(&error, g_error_free);
-				}
-				break;
-			}
-
-			switch (type) {
-			case RF_MSG_TYPE_FRAME:
-				ret = on_frame_msg(this);
-				break;
-			case RF_MSG_TYPE_INPUT:
-				ret = on_input_msg(this);
-				break;
-			case RF_MSG_TYPE_AUTH:
-				ret = on_auth_msg(this);
-				break;
-			default:
-				break;
-			}
-			if (ret <= 0)
-				break;
-		}
-
-		g_message("ReFrame Server disconnected.");
-
-		clean_drm(this);
-		clean_uinput(this);
-
-	close:
-		// Dropping the last reference of it will automatically close IO
-		// streams and socket.
-		g_clear_object(&this->connection);
+		run(this, listener, listen_socket);
 	} while (keep_listen);
 
 	g_socket_listener_close(listener);
+	g_clear_pointer(&this->clients, g_ptr_array_unref);
+	clean_monitor(this);
 	g_clear_object(&this->config);
 
 	return 0;